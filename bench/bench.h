@@ -0,0 +1,61 @@
+/* SPDX-License-Identifier: Apache-2.0 */
+/*
+ * Copyright (c) 2023 Ayush Singh <ayushdevel1325@gmail.com>
+ */
+
+#ifndef _BENCH_H_
+#define _BENCH_H_
+
+#include <stdint.h>
+#include <time.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+
+#define BENCH_UNIT "cycle"
+
+static inline uint64_t bench_now(void)
+{
+	return __rdtsc();
+}
+#else
+#define BENCH_UNIT "ns"
+
+static inline uint64_t bench_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000U + ts.tv_nsec;
+}
+#endif
+
+/* Deterministic xorshift32, so that failures can be reproduced from the seed */
+static inline uint32_t bench_rand(uint32_t *state)
+{
+	uint32_t x = *state;
+
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	*state = x;
+
+	return x;
+}
+
+/*
+ * Random payload byte. One in eight is a flag or escape byte, which is far more than real traffic
+ * has, so that escaping is well covered.
+ */
+static inline uint8_t bench_rand_byte(uint32_t *state)
+{
+	uint32_t r = bench_rand(state);
+
+	if ((r & 0x7) == 0) {
+		return (r & 0x8) ? 0x7E : 0x7D;
+	}
+
+	return r >> 8;
+}
+
+#endif
@@ -0,0 +1,292 @@
+// SPDX-License-Identifier: Apache-2.0
+/*
+ * Copyright (c) 2023 Ayush Singh <ayushdevel1325@gmail.com>
+ *
+ * Differential fuzz test of hdlc_deframe() against the original byte at a time state machine,
+ * followed by a benchmark of both.
+ *
+ * Random streams of valid, oversized and corrupted frames, stray flags and escapes are fed to the
+ * original deframer byte by byte, and to hdlc_deframe() in random chunks starting at random
+ * alignments. Both must report the same frames, overflows and final state.
+ *
+ * Usage: hdlc_deframe_bench [-c] [seed]
+ *   -c  only run the fuzz test
+ */
+
+#include "bench.h"
+#include "hdlc_codec.h"
+#include "hdlc_ref.h"
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define MAX_PAYLOAD   CONFIG_BEAGLEPLAY_HDLC_MAX_BLOCK_SIZE
+#define FUZZ_ROUNDS   20000
+#define STREAM_SIZE   8192
+#define MAX_FRAMES    (STREAM_SIZE / 2)
+#define BENCH_BYTES   (64U * 1024 * 1024)
+/* Typical UART receive ring claim */
+#define BENCH_CHUNK   64
+/* CRC residue of a frame received intact */
+#define HDLC_GOOD_CRC 0xf0b8
+
+/**
+ * struct frame_record - Frame reported by the original deframer
+ */
+struct frame_record {
+	uint16_t len;
+	uint16_t crc;
+	uint8_t buffer[MAX_PAYLOAD];
+};
+
+static uint8_t stream[STREAM_SIZE];
+static uint8_t aligned[STREAM_SIZE + 8];
+static uint8_t payload[2 * MAX_PAYLOAD];
+static struct frame_record records[MAX_FRAMES];
+static size_t records_len;
+static size_t records_checked;
+static int mismatch;
+
+static struct ref_deframer ref;
+static struct hdlc_deframer deframer;
+
+static void ref_record(struct ref_deframer *d, void *user_data)
+{
+	struct frame_record *record = &records[records_len++];
+
+	(void)user_data;
+
+	record->len = d->len;
+	record->crc = d->crc;
+	memcpy(record->buffer, d->buffer, d->len);
+}
+
+static void deframe_check(struct hdlc_deframer *d, void *user_data)
+{
+	const struct frame_record *record = &records[records_checked++];
+
+	(void)user_data;
+
+	if (records_checked > records_len || record->len != d->len || record->crc != d->crc ||
+	    memcmp(record->buffer, d->buffer, d->len) != 0) {
+		mismatch = 1;
+	}
+}
+
+/*
+ * Flip a single bit of a data byte of an encoded frame. The byte neither is nor becomes a flag or
+ * escape, so the framing stays intact and the CRC is guaranteed to be bad.
+ */
+static void frame_corrupt(uint32_t *seed, uint8_t *frame, size_t len)
+{
+	size_t pos;
+	uint8_t byte;
+
+	do {
+		/* Every frame has at least the address, control and two CRC bytes */
+		pos = 1 + bench_rand(seed) % (len - 2);
+		byte = frame[pos] ^ (1 << (bench_rand(seed) % 8));
+	} while (frame[pos] == HDLC_FRAME || frame[pos] == HDLC_ESC || byte == HDLC_FRAME ||
+		 byte == HDLC_ESC);
+
+	frame[pos] = byte;
+}
+
+/* Append a random segment to the stream. Returns the new stream length */
+static size_t stream_append(uint32_t *seed, size_t pos)
+{
+	uint8_t frame[HDLC_ENCODED_MAX_LEN(sizeof(payload))];
+	bool corrupt = false;
+	size_t len, i;
+
+	switch (bench_rand(seed) % 6) {
+	case 0:
+	case 1:
+		/* Valid frame */
+		len = bench_rand(seed) % (MAX_PAYLOAD - 3);
+		break;
+	case 2:
+		/* Frame which overflows the receive buffer */
+		len = MAX_PAYLOAD - 4 + bench_rand(seed) % MAX_PAYLOAD;
+		break;
+	case 3:
+		/* Garbage */
+		len = bench_rand(seed) % 32;
+		for (i = 0; i < len && pos < STREAM_SIZE; ++i) {
+			stream[pos++] = bench_rand_byte(seed);
+		}
+		return pos;
+	case 4: {
+		/* Stray flags and escapes, including an escape right before a flag */
+		static const uint8_t specials[] = {HDLC_FRAME, HDLC_ESC, HDLC_ESC, HDLC_FRAME};
+
+		len = 1 + bench_rand(seed) % 4;
+		for (i = 0; i < len && pos < STREAM_SIZE; ++i) {
+			stream[pos++] = specials[bench_rand(seed) % sizeof(specials)];
+		}
+		return pos;
+	}
+	default:
+		/* Valid frame with a flipped bit */
+		len = bench_rand(seed) % (MAX_PAYLOAD - 3);
+		corrupt = true;
+		break;
+	}
+
+	for (i = 0; i < len; ++i) {
+		payload[i] = bench_rand_byte(seed);
+	}
+
+	len = ref_frame_encode(frame, payload, len, bench_rand_byte(seed), bench_rand_byte(seed));
+	if (corrupt) {
+		frame_corrupt(seed, frame, len);
+	}
+
+	/* Back to back frames may share a single flag */
+	i = (pos && stream[pos - 1] == HDLC_FRAME && bench_rand(seed) % 2) ? 1 : 0;
+	for (; i < len && pos < STREAM_SIZE; ++i) {
+		stream[pos++] = frame[i];
+	}
+
+	return pos;
+}
+
+static int fuzz(uint32_t seed)
+{
+	size_t len, align, pos, chunk, i;
+	unsigned long frames = 0, bad_crc = 0;
+
+	for (unsigned int round = 0; round < FUZZ_ROUNDS; ++round) {
+		len = 0;
+		while (len < STREAM_SIZE / 2) {
+			len = stream_append(&seed, len);
+		}
+
+		ref_deframer_init(&ref);
+		records_len = 0;
+		for (i = 0; i < len; ++i) {
+			ref_deframe_byte(&ref, stream[i], ref_record, NULL);
+		}
+
+		align = bench_rand(&seed) % 8;
+		memcpy(&aligned[align], stream, len);
+
+		memset(&deframer, 0, sizeof(deframer));
+		hdlc_deframer_init(&deframer);
+		records_checked = 0;
+		mismatch = 0;
+		for (pos = 0; pos < len; pos += chunk) {
+			/* Mostly short chunks, as the UART ISR delivers, sometimes long ones */
+			chunk = 1 + bench_rand(&seed) % ((bench_rand(&seed) % 4) ? 16 : 512);
+			chunk = (chunk < len - pos) ? chunk : len - pos;
+			hdlc_deframe(&deframer, &aligned[align + pos], chunk, deframe_check, NULL);
+		}
+
+		if (mismatch || records_checked != records_len ||
+		    deframer.overflows != ref.overflows || deframer.len != ref.len ||
+		    deframer.crc != ref.crc || deframer.next_escaped != ref.next_escaped ||
+		    memcmp(deframer.buffer, ref.buffer, ref.len) != 0) {
+			fprintf(stderr, "Deframer mismatch in round %u (align %zu)\n", round, align);
+			return -1;
+		}
+
+		frames += records_len;
+		for (i = 0; i < records_len; ++i) {
+			bad_crc += records[i].crc != HDLC_GOOD_CRC;
+		}
+	}
+
+	if (bad_crc == 0) {
+		fprintf(stderr, "No frame with a bad CRC was generated\n");
+		return -1;
+	}
+
+	printf("deframe: %u random streams, %lu frames (%lu with a bad CRC) identical to the byte "
+	       "path\n",
+	       FUZZ_ROUNDS, frames, bad_crc);
+
+	return 0;
+}
+
+static void ref_discard(struct ref_deframer *d, void *user_data)
+{
+	(void)d;
+	(*(size_t *)user_data)++;
+}
+
+static void deframe_discard(struct hdlc_deframer *d, void *user_data)
+{
+	(void)d;
+	(*(size_t *)user_data)++;
+}
+
+static void bench(uint32_t seed, size_t frame_len)
+{
+	size_t len = 0, rounds, i, pos, frames = 0;
+	uint64_t start, new_time, ref_time;
+
+	/* Back to back frames of uniformly random bytes */
+	while (len + HDLC_ENCODED_MAX_LEN(frame_len) <= STREAM_SIZE) {
+		for (i = 0; i < frame_len; ++i) {
+			payload[i] = bench_rand(&seed);
+		}
+		len += ref_frame_encode(&stream[len], payload, frame_len, 0x01, 0x03);
+	}
+	rounds = BENCH_BYTES / len;
+
+	hdlc_deframer_init(&deframer);
+	start = bench_now();
+	for (i = 0; i < rounds; ++i) {
+		for (pos = 0; pos < len; pos += BENCH_CHUNK) {
+			hdlc_deframe(&deframer, &stream[pos], (len - pos < BENCH_CHUNK) ? len - pos
+										: BENCH_CHUNK,
+				     deframe_discard, &frames);
+		}
+	}
+	new_time = bench_now() - start;
+
+	ref_deframer_init(&ref);
+	start = bench_now();
+	for (i = 0; i < rounds; ++i) {
+		for (pos = 0; pos < len; ++pos) {
+			ref_deframe_byte(&ref, stream[pos], ref_discard, &frames);
+		}
+	}
+	ref_time = bench_now() - start;
+
+	printf("deframe %3zu B frames: %.2f %s/B (byte path %.2f %s/B), %.1fx\n", frame_len,
+	       (double)new_time / (rounds * len), BENCH_UNIT, (double)ref_time / (rounds * len),
+	       BENCH_UNIT, (double)ref_time / new_time);
+}
+
+int main(int argc, char **argv)
+{
+	const size_t sizes[] = {16, 64, MAX_PAYLOAD - 4};
+	uint32_t seed = 0x12345678;
+	int argi = 1;
+	int check_only = 0;
+
+	if (argi < argc && strcmp(argv[argi], "-c") == 0) {
+		check_only = 1;
+		argi++;
+	}
+
+	if (argi < argc) {
+		seed = strtoul(argv[argi], NULL, 0);
+	}
+
+	if (fuzz(seed) < 0) {
+		return EXIT_FAILURE;
+	}
+
+	if (check_only) {
+		return EXIT_SUCCESS;
+	}
+
+	for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); ++i) {
+		bench(seed, sizes[i]);
+	}
+
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,128 @@
+// SPDX-License-Identifier: Apache-2.0
+/*
+ * Copyright (c) 2023 Ayush Singh <ayushdevel1325@gmail.com>
+ *
+ * Checks hdlc_frame_encode() against the original byte at a time encoder and measures both.
+ *
+ * Usage: hdlc_encode_bench [-c] [seed]
+ *   -c  only run the equivalence check
+ */
+
+#include "bench.h"
+#include "hdlc_codec.h"
+#include "hdlc_ref.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define MAX_PAYLOAD  CONFIG_BEAGLEPLAY_HDLC_MAX_BLOCK_SIZE
+#define CHECK_ROUNDS 200000
+#define BENCH_BYTES  (64U * 1024 * 1024)
+
+static uint8_t payload[MAX_PAYLOAD + 8];
+static uint8_t out[HDLC_ENCODED_MAX_LEN(MAX_PAYLOAD)];
+static uint8_t ref_out[HDLC_ENCODED_MAX_LEN(MAX_PAYLOAD)];
+
+static int check(uint32_t seed)
+{
+	struct hdlc_iovec iov[3];
+	size_t len, align, split[2], out_len, ref_len, i;
+	uint8_t address, control;
+	uint16_t crc;
+
+	for (unsigned int round = 0; round < CHECK_ROUNDS; ++round) {
+		len = bench_rand(&seed) % (MAX_PAYLOAD + 1);
+		align = bench_rand(&seed) % 8;
+		address = bench_rand_byte(&seed);
+		control = bench_rand_byte(&seed);
+		for (i = 0; i < len; ++i) {
+			payload[align + i] = bench_rand_byte(&seed);
+		}
+
+		crc = bench_rand(&seed);
+		if (hdlc_crc16(crc, &payload[align], len) !=
+		    ref_crc16_ccitt(crc, &payload[align], len)) {
+			fprintf(stderr, "CRC mismatch in round %u (len %zu)\n", round, len);
+			return -1;
+		}
+
+		/* Split the payload into up to three, possibly empty, scatter-gather elements */
+		split[0] = len ? bench_rand(&seed) % (len + 1) : 0;
+		split[1] = split[0] + ((len - split[0]) ? bench_rand(&seed) % (len - split[0] + 1) : 0);
+		iov[0] = (struct hdlc_iovec){&payload[align], split[0]};
+		iov[1] = (struct hdlc_iovec){&payload[align + split[0]], split[1] - split[0]};
+		iov[2] = (struct hdlc_iovec){&payload[align + split[1]], len - split[1]};
+
+		out_len = hdlc_frame_encode(out, iov, 3, address, control);
+		ref_len = ref_frame_encode(ref_out, &payload[align], len, address, control);
+		if (out_len != ref_len || memcmp(out, ref_out, out_len) != 0) {
+			fprintf(stderr, "Encoding mismatch in round %u (len %zu, align %zu)\n", round,
+				len, align);
+			return -1;
+		}
+	}
+
+	printf("encode: %u random frames identical to the byte path\n", CHECK_ROUNDS);
+
+	return 0;
+}
+
+static void bench(uint32_t seed, size_t len)
+{
+	const struct hdlc_iovec iov = {payload, len};
+	size_t rounds = BENCH_BYTES / len, i;
+	uint64_t start, new_time, ref_time;
+	volatile size_t sink = 0;
+
+	/* Uniformly random bytes, so about 1 in 128 needs escaping as in real traffic */
+	for (i = 0; i < len; ++i) {
+		payload[i] = bench_rand(&seed);
+	}
+
+	start = bench_now();
+	for (i = 0; i < rounds; ++i) {
+		sink += hdlc_frame_encode(out, &iov, 1, 0x01, 0x03);
+	}
+	new_time = bench_now() - start;
+
+	start = bench_now();
+	for (i = 0; i < rounds; ++i) {
+		sink += ref_frame_encode(ref_out, payload, len, 0x01, 0x03);
+	}
+	ref_time = bench_now() - start;
+
+	printf("encode %3zu B: %.3f B/%s (byte path %.3f B/%s), %.1fx\n", len,
+	       (double)rounds * len / new_time, BENCH_UNIT, (double)rounds * len / ref_time,
+	       BENCH_UNIT, (double)ref_time / new_time);
+}
+
+int main(int argc, char **argv)
+{
+	const size_t sizes[] = {16, 64, MAX_PAYLOAD};
+	uint32_t seed = 0x12345678;
+	int argi = 1;
+	int check_only = 0;
+
+	if (argi < argc && strcmp(argv[argi], "-c") == 0) {
+		check_only = 1;
+		argi++;
+	}
+
+	if (argi < argc) {
+		seed = strtoul(argv[argi], NULL, 0);
+	}
+
+	if (check(seed) < 0) {
+		return EXIT_FAILURE;
+	}
+
+	if (check_only) {
+		return EXIT_SUCCESS;
+	}
+
+	for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); ++i) {
+		bench(seed, sizes[i]);
+	}
+
+	return EXIT_SUCCESS;
+}
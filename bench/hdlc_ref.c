@@ -0,0 +1,99 @@
+// SPDX-License-Identifier: Apache-2.0
+/*
+ * Copyright (c) 2016-2019 Intel Corporation
+ * Copyright (c) 2020 Statropy Software LLC
+ *
+ * Modifications Copyright (c) 2023 Ayush Singh <ayushdevel1325@gmail.com>
+ */
+
+#include "hdlc_ref.h"
+#include "hdlc_codec.h"
+
+uint16_t ref_crc16_ccitt(uint16_t seed, const uint8_t *src, size_t len)
+{
+	for (; len > 0; len--) {
+		uint8_t e, f;
+
+		e = seed ^ *src++;
+		f = e ^ (e << 4);
+		seed = (seed >> 8) ^ ((uint16_t)f << 8) ^ ((uint16_t)f << 3) ^ ((uint16_t)f >> 4);
+	}
+
+	return seed;
+}
+
+static void ref_put_crc(uint8_t *dst, size_t *pos, uint8_t byte, uint16_t *crc)
+{
+	*crc = ref_crc16_ccitt(*crc, &byte, 1);
+	if (byte == HDLC_FRAME || byte == HDLC_ESC) {
+		dst[(*pos)++] = HDLC_ESC;
+		byte ^= 0x20;
+	}
+	dst[(*pos)++] = byte;
+}
+
+size_t ref_frame_encode(uint8_t *dst, const uint8_t *buf, size_t len, uint8_t address,
+			uint8_t control)
+{
+	uint16_t crc = 0xffff;
+	uint16_t crc_calc;
+	size_t pos = 0;
+
+	dst[pos++] = HDLC_FRAME;
+	ref_put_crc(dst, &pos, address, &crc);
+	ref_put_crc(dst, &pos, control, &crc);
+
+	for (size_t i = 0; i < len; i++) {
+		ref_put_crc(dst, &pos, buf[i], &crc);
+	}
+
+	crc_calc = crc ^ 0xffff;
+	ref_put_crc(dst, &pos, crc_calc, &crc);
+	ref_put_crc(dst, &pos, crc_calc >> 8, &crc);
+	dst[pos++] = HDLC_FRAME;
+
+	return pos;
+}
+
+void ref_deframer_init(struct ref_deframer *deframer)
+{
+	deframer->crc = 0xffff;
+	deframer->next_escaped = false;
+	deframer->len = 0;
+	deframer->overflows = 0;
+}
+
+static void ref_save_byte(struct ref_deframer *deframer, uint8_t byte)
+{
+	if (deframer->len >= CONFIG_BEAGLEPLAY_HDLC_MAX_BLOCK_SIZE) {
+		deframer->overflows++;
+		deframer->crc = 0xffff;
+		deframer->len = 0;
+	}
+
+	deframer->buffer[deframer->len++] = byte;
+}
+
+void ref_deframe_byte(struct ref_deframer *deframer, uint8_t byte, ref_deframe_callback cb,
+		      void *user_data)
+{
+	switch (byte) {
+	case HDLC_FRAME:
+		if (deframer->len) {
+			cb(deframer, user_data);
+			deframer->crc = 0xffff;
+			deframer->len = 0;
+		}
+		break;
+	case HDLC_ESC:
+		deframer->next_escaped = true;
+		break;
+	default:
+		if (deframer->next_escaped) {
+			byte ^= 0x20;
+			deframer->next_escaped = false;
+		}
+		deframer->crc = ref_crc16_ccitt(deframer->crc, &byte, 1);
+		ref_save_byte(deframer, byte);
+	}
+}
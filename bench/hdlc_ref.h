@@ -0,0 +1,64 @@
+/* SPDX-License-Identifier: Apache-2.0 */
+/*
+ * Copyright (c) 2023 Ayush Singh <ayushdevel1325@gmail.com>
+ */
+
+#ifndef _HDLC_REF_H_
+#define _HDLC_REF_H_
+
+/*
+ * The original byte at a time HDLC implementation, which the optimized codec in src/hdlc_codec.c
+ * is checked against.
+ */
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * struct ref_deframer - Receive state of the original deframer
+ *
+ * @crc: CRC over the unescaped bytes of the current frame
+ * @next_escaped: the previous byte was an escape byte
+ * @len: bytes in @buffer
+ * @overflows: frames which did not fit in @buffer so far
+ * @buffer: current frame
+ */
+struct ref_deframer {
+	uint16_t crc;
+	bool next_escaped;
+	uint16_t len;
+	uint32_t overflows;
+	uint8_t buffer[CONFIG_BEAGLEPLAY_HDLC_MAX_BLOCK_SIZE];
+};
+
+/*
+ * Bitwise CRC-16/CCITT, as crc16_ccitt() in Zephyr
+ */
+uint16_t ref_crc16_ccitt(uint16_t seed, const uint8_t *src, size_t len);
+
+/*
+ * Encode a frame one byte at a time, as hdlc_block_send_sync() used to
+ *
+ * @return encoded frame length
+ */
+size_t ref_frame_encode(uint8_t *dst, const uint8_t *buf, size_t len, uint8_t address,
+			uint8_t control);
+
+/*
+ * Callback for every frame closed by a flag byte
+ */
+typedef void (*ref_deframe_callback)(struct ref_deframer *, void *);
+
+/*
+ * Reset the original deframer
+ */
+void ref_deframer_init(struct ref_deframer *deframer);
+
+/*
+ * Feed one byte to the original deframer, as hdlc_rx_input_byte() used to
+ */
+void ref_deframe_byte(struct ref_deframer *deframer, uint8_t byte, ref_deframe_callback cb,
+		      void *user_data);
+
+#endif
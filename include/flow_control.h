@@ -0,0 +1,56 @@
+/* SPDX-License-Identifier: Apache-2.0 */
+/*
+ * Copyright (c) 2023 Ayush Singh <ayushdevel1325@gmail.com>
+ */
+
+#ifndef _FLOW_CONTROL_H_
+#define _FLOW_CONTROL_H_
+
+#include <stdint.h>
+
+#ifdef CONFIG_BEAGLEPLAY_FLOW_CONTROL
+/*
+ * Grant the AP credits to send messages to an interface. Grants are batched and sent from the
+ * system work queue. Safe to call from any thread.
+ *
+ * @param interface id
+ * @param number of messages
+ */
+void flow_control_grant(uint8_t intf_id, uint16_t credits);
+
+/*
+ * Grant the AP credits to send messages to an interface right away, without batching. Used for
+ * the initial credits of a new interface, which the AP must have before the module is announced.
+ * Does not wait for space in the HDLC TX ring, the caller retries instead.
+ *
+ * Note: Must not be called from ISR.
+ *
+ * @param interface id
+ * @param number of messages
+ *
+ * @return 0 if successful. -EAGAIN if the HDLC TX ring is full. Negative in case of error
+ */
+int flow_control_grant_sync(uint8_t intf_id, uint8_t credits);
+
+/*
+ * Drop credits not sent yet for an interface which is going away
+ *
+ * @param interface id
+ */
+void flow_control_forget(uint8_t intf_id);
+#else
+static inline void flow_control_grant(uint8_t intf_id, uint16_t credits)
+{
+}
+
+static inline int flow_control_grant_sync(uint8_t intf_id, uint8_t credits)
+{
+	return 0;
+}
+
+static inline void flow_control_forget(uint8_t intf_id)
+{
+}
+#endif
+
+#endif
@@ -6,17 +6,55 @@
 #ifndef _HDLC_H_
 #define _HDLC_H_
 
+#include "hdlc_codec.h"
 #include <stdint.h>
 #include <zephyr/device.h>
 #include <greybus/greybus_messages.h>
 
-#define HDLC_MAX_BLOCK_SIZE CONFIG_BEAGLEPLAY_HDLC_MAX_BLOCK_SIZE
-
 #define ADDRESS_GREYBUS 0x01
 #define ADDRESS_DBG     0x02
 #define ADDRESS_CONTROL 0x03
 #define ADDRESS_MCUMGR  0x04
 
+/*
+ * Reserved cport of a Greybus HDLC frame carrying several Greybus frames back to back. Each of
+ * them is a cport followed by a Greybus message, whose header size delimits the record.
+ */
+#define HDLC_GREYBUS_CPORT_AGGREGATE 0xffff
+
+/*
+ * Reserved cport of a Greybus HDLC frame carrying a fragment of a larger Greybus frame. It is
+ * followed by a flags byte and the next chunk of the original frame.
+ */
+#define HDLC_GREYBUS_CPORT_FRAGMENT 0xfffe
+#define HDLC_GREYBUS_FRAGMENT_FIRST BIT(0)
+#define HDLC_GREYBUS_FRAGMENT_LAST  BIT(1)
+
+/*
+ * Transmit classes, in order of priority. Greybus, control and other frames share
+ * HDLC_TX_CLASS_GREYBUS, debug frames use HDLC_TX_CLASS_DEBUG.
+ */
+enum hdlc_tx_class {
+	HDLC_TX_CLASS_GREYBUS,
+	HDLC_TX_CLASS_DEBUG,
+	HDLC_TX_CLASS_COUNT,
+};
+
+/**
+ * struct hdlc_tx_stats - Transmit statistics of a class
+ *
+ * @frames: frames queued
+ * @bytes: encoded bytes queued
+ * @dropped: frames dropped because the ring stayed full
+ * @max_used: highest ring usage in bytes
+ */
+struct hdlc_tx_stats {
+	uint32_t frames;
+	uint32_t bytes;
+	uint32_t dropped;
+	uint32_t max_used;
+};
+
 /*
  * Calback to process a received HDLC frame
  *
@@ -38,15 +76,44 @@ typedef int (*hdlc_process_frame_callback)(const void *, size_t, uint8_t);
  */
 typedef int (*hdlc_send_frame_callback)(const uint8_t *, size_t);
 
+/*
+ * Callback to notify the transport that encoded HDLC data is waiting in the TX ring
+ */
+typedef void (*hdlc_tx_notify_callback)(void);
+
+/*
+ * Callback to let the transport receive again after hdlc_rx_start ran out of space
+ */
+typedef void (*hdlc_rx_resume_callback)(void);
+
 /*
  * Initialize internal HDLC stuff
  *
+ * @param callback to process received frames
+ * @param callback used by synchronous send
+ * @param callback used to kick the transport when asynchronous data is queued
+ *
  * @return 0 if successful. Negative in case of error.
  */
-int hdlc_init(hdlc_process_frame_callback process_cb, hdlc_send_frame_callback send_cb);
+int hdlc_init(hdlc_process_frame_callback process_cb, hdlc_send_frame_callback send_cb,
+	      hdlc_tx_notify_callback tx_cb);
+
+/*
+ * Reset link state, i.e. sequence numbers and unacknowledged frames. Used when the AP (re)starts.
+ */
+void hdlc_link_reset(void);
 
 /*
- * Submit an HDLC Block synchronously
+ * Switch synchronous sends to panic mode. Frames are then polled out with interrupts locked,
+ * without waiting for the TX interrupt to drain the rings.
+ */
+void hdlc_panic(void);
+
+/*
+ * Submit an HDLC Block synchronously. Waits for the TX rings to drain first, so frames already
+ * queued go out before it.
+ *
+ * Note: Must not be called from ISR, unless after hdlc_panic.
  *
  * @param buffer
  * @param buffer_length
@@ -58,9 +125,66 @@ int hdlc_init(hdlc_process_frame_callback process_cb, hdlc_send_frame_callback s
 int hdlc_block_send_sync(const uint8_t *buffer, size_t buffer_len, uint8_t address,
 			 uint8_t control);
 
+/*
+ * Submit an HDLC Block asynchronously. Returns as soon as the encoded frame is queued in the TX
+ * ring. Blocks for up to CONFIG_BEAGLEPLAY_HDLC_TX_TIMEOUT_MS if the ring is full, without
+ * holding up other producers of the ring.
+ *
+ * With CONFIG_BEAGLEPLAY_HDLC_RELIABLE, blocks on ADDRESS_GREYBUS are sent as I-frames and the
+ * control parameter is ignored. The call also blocks while the send window is full.
+ *
+ * Note: Must not be called from ISR.
+ *
+ * @param buffer
+ * @param buffer_length
+ * @param address
+ * @param control
+ *
+ * @return 0 if successful. -EAGAIN if the TX ring stayed full. Negative in case of error
+ */
+int hdlc_block_send_async(const uint8_t *buffer, size_t buffer_len, uint8_t address,
+			  uint8_t control);
+
+/*
+ * Submit an HDLC Block asynchronously without waiting for ring or window space. Meant for work
+ * items on shared work queues, which retry later on their own. A failure is not counted as a
+ * dropped frame.
+ *
+ * Note: Must not be called from ISR.
+ *
+ * @param buffer
+ * @param buffer_length
+ * @param address
+ * @param control
+ *
+ * @return 0 if successful. -EAGAIN if the TX ring is full. Negative in case of error
+ */
+int hdlc_block_send_try(const uint8_t *buffer, size_t buffer_len, uint8_t address,
+			uint8_t control);
+
+/*
+ * Submit an HDLC Block gathered from multiple buffers asynchronously. The buffers are encoded
+ * directly, without being copied into an intermediate payload buffer.
+ *
+ * Note: Must not be called from ISR.
+ *
+ * @param scatter-gather list
+ * @param number of elements in the list
+ * @param address
+ * @param control
+ *
+ * @return 0 if successful. -EMSGSIZE if the total length exceeds HDLC_MAX_BLOCK_SIZE. -EAGAIN
+ * if the TX ring stayed full. Negative in case of error
+ */
+int hdlc_block_send_iov_async(const struct hdlc_iovec *iov, size_t iovcnt, uint8_t address,
+			      uint8_t control);
+
 /*
  * Get a buffer to write HDLC message received for processing. Make HDLC transport agnostic.
  *
+ * If the buffer is full, the transport should stop receiving, leaving further data to its own
+ * flow control, until the callback set with hdlc_rx_set_resume_callback is called.
+ *
  * @param the pointer to underlying buffer which can be used to write.
  *
  * @return number of bytes that can be written
@@ -77,22 +201,93 @@ uint32_t hdlc_rx_start(uint8_t **buffer);
 int hdlc_rx_finish(uint32_t written);
 
 /*
- * Send a greybus message over HDLC
+ * Set a callback to be called from the HDLC receive work queue once space has been freed after
+ * hdlc_rx_start returned 0.
  *
- * @param Greybus message
+ * @param callback
+ */
+void hdlc_rx_set_resume_callback(hdlc_rx_resume_callback cb);
+
+/*
+ * Get the cycle counter at which the frame being processed had been received. This is the time of
+ * the last hdlc_rx_finish before its final bytes were picked up for processing, so it includes the
+ * time the frame waited for the receive work queue.
+ *
+ * Note: Only meaningful from the process frame callback.
+ *
+ * @return cycle count
+ */
+uint32_t hdlc_rx_cycles(void);
+
+/*
+ * Get encoded HDLC data waiting to be transmitted. Make HDLC transport agnostic.
+ *
+ * Data is handed out one frame at a time so that higher priority classes can go ahead of queued
+ * debug frames. A started frame is always completed before another one is picked.
+ *
+ * @param the pointer to underlying buffer which can be read.
+ *
+ * @return number of bytes that can be read
+ */
+uint32_t hdlc_tx_start(uint8_t **buffer);
+
+/*
+ * Finish reading from tx buffer. Safe to call from ISR.
+ *
+ * @param number of bytes transmitted
+ *
+ * @return 0 if successful. Negative in case of error.
+ */
+int hdlc_tx_finish(uint32_t sent);
+
+/*
+ * Set a callback to be called from hdlc_tx_finish once all queued data has been transmitted.
+ * Called from ISR.
+ *
+ * @param callback
  */
-static inline int gb_message_hdlc_send(struct gb_message *msg, uint16_t cport)
-{
-	char buffer[HDLC_MAX_BLOCK_SIZE];
+void hdlc_tx_set_idle_callback(hdlc_tx_notify_callback cb);
 
-	memcpy(buffer, &sys_cpu_to_le16(cport), sizeof(cport));
-	memcpy(&buffer[sizeof(cport)], &msg->header, sizeof(struct gb_operation_msg_hdr));
-	memcpy(&buffer[sizeof(struct gb_operation_msg_hdr) + sizeof(cport)], msg->payload,
-	       gb_message_payload_len(msg));
+/*
+ * Check if there is no data waiting to be transmitted
+ *
+ * @return true if idle
+ */
+bool hdlc_tx_is_idle(void);
+
+/*
+ * Check if the Greybus transmit ring is filled above CONFIG_BEAGLEPLAY_HDLC_TX_CONGESTION_PERCENT
+ *
+ * @return true if congested
+ */
+bool hdlc_tx_congested(void);
 
-	hdlc_block_send_sync(buffer, msg->header.size + sizeof(cport), ADDRESS_GREYBUS, 0x03);
+/*
+ * Get transmit statistics of a class
+ *
+ * @param class
+ * @param statistics output
+ *
+ * @return 0 if successful. -EINVAL if the class is invalid
+ */
+int hdlc_tx_stats_get(enum hdlc_tx_class class, struct hdlc_tx_stats *stats);
 
-	return 0;
-}
+/*
+ * Send a greybus message over HDLC. The cport, header and payload are encoded in place.
+ *
+ * With CONFIG_BEAGLEPLAY_HDLC_GREYBUS_AGGREGATE, the message may be held back to share a frame
+ * with later messages. Held back messages are kept until their frame is sent. If the pending frame
+ * cannot be sent to make room for this message, this message is refused with -EAGAIN.
+ *
+ * With CONFIG_BEAGLEPLAY_HDLC_GREYBUS_FRAGMENT, messages larger than a HDLC block are sent as
+ * multiple fragments.
+ *
+ * @param Greybus message
+ * @param cport_id
+ *
+ * @return 0 if successful. -EMSGSIZE if message does not fit in a HDLC block and fragmentation is
+ * disabled. Negative in case of error
+ */
+int gb_message_hdlc_send(struct gb_message *msg, uint16_t cport);
 
 #endif
@@ -0,0 +1,131 @@
+/* SPDX-License-Identifier: Apache-2.0 */
+/*
+ * Copyright (c) 2023 Ayush Singh <ayushdevel1325@gmail.com>
+ */
+
+#ifndef _HDLC_CODEC_H_
+#define _HDLC_CODEC_H_
+
+/*
+ * HDLC framing, escaping and CRC. Does not depend on Zephyr, so that it can also be built and
+ * tested on the host (see bench/).
+ */
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define HDLC_MAX_BLOCK_SIZE CONFIG_BEAGLEPLAY_HDLC_MAX_BLOCK_SIZE
+
+#define HDLC_FRAME     0x7E
+#define HDLC_ESC       0x7D
+#define HDLC_ESC_FRAME 0x5E
+#define HDLC_ESC_ESC   0x5D
+
+/* Opening flag, escaped address, control, payload and crc, closing flag */
+#define HDLC_ENCODED_MAX_LEN(len) (2 + 2 * ((len) + 4))
+
+/**
+ * struct hdlc_iovec - Scatter-gather element of an HDLC payload
+ *
+ * @base: start of the buffer
+ * @len: length of the buffer
+ */
+struct hdlc_iovec {
+	const void *base;
+	size_t len;
+};
+
+/**
+ * struct hdlc_deframer - Receive state of an HDLC byte stream
+ *
+ * @crc: CRC over the unescaped bytes of the current frame
+ * @next_escaped: the previous byte was an escape byte
+ * @len: bytes in @buffer
+ * @escapes: escape bytes seen so far
+ * @overflows: frames which did not fit in @buffer so far
+ * @buffer: unescaped address, control, payload and CRC of the current frame
+ */
+struct hdlc_deframer {
+	uint16_t crc;
+	bool next_escaped;
+	uint16_t len;
+	uint32_t escapes;
+	uint32_t overflows;
+	uint8_t buffer[HDLC_MAX_BLOCK_SIZE];
+};
+
+/*
+ * Callback for every frame closed by a flag byte. The frame is only valid if its length is more
+ * than 3 and its CRC is 0xf0b8.
+ *
+ * @param deframer holding the frame
+ * @param user data
+ */
+typedef void (*hdlc_deframe_callback)(struct hdlc_deframer *, void *);
+
+/*
+ * Get the total length of a scatter-gather list
+ *
+ * @param scatter-gather list
+ * @param number of elements in the list
+ *
+ * @return total length in bytes
+ */
+size_t hdlc_iov_len(const struct hdlc_iovec *iov, size_t iovcnt);
+
+/*
+ * Update a CRC-16/CCITT (reflected, polynomial 0x8408). Matches crc16_ccitt().
+ *
+ * @param crc so far
+ * @param buffer
+ * @param buffer length
+ *
+ * @return updated crc
+ */
+uint16_t hdlc_crc16(uint16_t crc, const uint8_t *buf, size_t len);
+
+/*
+ * Get the length of the leading run of bytes which are neither flag nor escape bytes
+ *
+ * @param buffer
+ * @param buffer length
+ *
+ * @return run length
+ */
+size_t hdlc_clean_run_len(const uint8_t *buf, size_t len);
+
+/*
+ * Encode a complete HDLC frame, including both flags, from a scatter-gather list
+ *
+ * @param destination, able to hold HDLC_ENCODED_MAX_LEN(hdlc_iov_len(iov, iovcnt)) bytes
+ * @param scatter-gather list of the payload
+ * @param number of elements in the list
+ * @param address
+ * @param control
+ *
+ * @return encoded frame length
+ */
+size_t hdlc_frame_encode(uint8_t *dst, const struct hdlc_iovec *iov, size_t iovcnt,
+			 uint8_t address, uint8_t control);
+
+/*
+ * Reset a deframer to expect a new frame
+ *
+ * @param deframer
+ */
+void hdlc_deframer_init(struct hdlc_deframer *deframer);
+
+/*
+ * Unescape a chunk of an HDLC byte stream. Chunks may split frames at any point.
+ *
+ * @param deframer
+ * @param chunk
+ * @param chunk length
+ * @param callback for every closed frame
+ * @param user data passed to the callback
+ */
+void hdlc_deframe(struct hdlc_deframer *deframer, const uint8_t *buf, size_t len,
+		  hdlc_deframe_callback cb, void *user_data);
+
+#endif
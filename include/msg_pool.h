@@ -0,0 +1,78 @@
+/* SPDX-License-Identifier: Apache-2.0 */
+/*
+ * Copyright (c) 2023 Ayush Singh <ayushdevel1325@gmail.com>
+ */
+
+#ifndef _MSG_POOL_H_
+#define _MSG_POOL_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <greybus/greybus_messages.h>
+
+/* Small, medium and large, plus a class for reassembled messages with fragmentation */
+#ifdef CONFIG_BEAGLEPLAY_HDLC_GREYBUS_FRAGMENT
+#define MSG_POOL_CLASSES 4
+#else
+#define MSG_POOL_CLASSES 3
+#endif
+
+/**
+ * struct msg_pool_stats - Usage of a message pool size class
+ *
+ * @payload_size: largest payload of the class
+ * @num_blocks: number of messages in the class
+ * @used: messages currently allocated
+ * @max_used: high-water mark of allocated messages
+ * @failures: allocations which failed because the class and all larger ones were exhausted
+ */
+struct msg_pool_stats {
+	uint16_t payload_size;
+	uint16_t num_blocks;
+	uint16_t used;
+	uint16_t max_used;
+	uint32_t failures;
+};
+
+/*
+ * Allocate a greybus message from the fixed size message pools. O(1) and does not touch the
+ * system heap, unless the payload is larger than the largest size class.
+ *
+ * Pooled messages must be released with msg_pool_free by the code that owns them. They must not
+ * be handed to code which releases them with gb_message_dealloc, like the SVC of the greybus
+ * library. Use msg_pool_alloc_heap for those.
+ *
+ * @param header of the message as received, which gives the payload length
+ *
+ * @return greybus message or NULL if the pool is exhausted
+ */
+struct gb_message *msg_pool_alloc(const struct gb_operation_msg_hdr *hdr);
+
+/*
+ * Allocate a greybus message on the system heap, like gb_message_alloc. It can be released with
+ * either gb_message_dealloc or msg_pool_free.
+ *
+ * @param header of the message as received, which gives the payload length
+ *
+ * @return greybus message or NULL if the heap is exhausted
+ */
+struct gb_message *msg_pool_alloc_heap(const struct gb_operation_msg_hdr *hdr);
+
+/*
+ * Release a greybus message allocated from the pools, from the heap, or by the greybus library
+ *
+ * @param greybus message
+ */
+void msg_pool_free(struct gb_message *msg);
+
+/*
+ * Get usage statistics of a size class
+ *
+ * @param size class, smallest first
+ * @param statistics
+ *
+ * @return 0 if successful. Negative in case of error
+ */
+int msg_pool_stats_get(size_t size_class, struct msg_pool_stats *stats);
+
+#endif
@@ -11,28 +11,91 @@
 
 #define GB_TRANSPORT_TCPIP_BASE_PORT 4242
 
+/**
+ * struct node_tx_stats - Transmit queue statistics of a node
+ *
+ * @depth: messages currently queued
+ * @max_depth: high-water mark of depth
+ * @sent: messages sent
+ * @dropped: messages dropped because the queue was full
+ */
+struct node_tx_stats {
+	uint16_t depth;
+	uint16_t max_depth;
+	uint32_t sent;
+	uint32_t dropped;
+};
+
+/**
+ * struct node_stats - Traffic statistics of a node
+ *
+ * @rx_msgs: messages received from the node
+ * @rx_bytes: bytes received from the node
+ * @tx_msgs: messages sent to the node
+ * @tx_bytes: bytes sent to the node
+ * @errors: lost connections, failed reconnects and messages the node sent which were dropped
+ * @reconnects: successful reconnects
+ */
+struct node_stats {
+	uint32_t rx_msgs;
+	uint32_t rx_bytes;
+	uint32_t tx_msgs;
+	uint32_t tx_bytes;
+	uint32_t errors;
+	uint32_t reconnects;
+};
+
 /*
- * Destroy a tcp greybus interface
+ * Destroy a tcp greybus interface. The node is removed by its node worker, which closes the
+ * connection and releases queued messages. Waits until that is done.
+ *
+ * Note: Must not be called from a node worker.
  *
- * @return greybus interface
+ * @param greybus interface
  */
 void node_destroy_interface(struct gb_interface *intf);
 
 /*
- * Checks if any new nodes have been added or any previous nodes removed.
+ * Reconcile the node cache with the result of a discovery round. New nodes are added and inserted
+ * as one batch, nodes missing from too many consecutive rounds are removed.
  *
- * @param list of nodes discovered
+ * @param deduplicated list of nodes discovered in the round
  * @param lenght of nodes list
  */
 void node_filter(struct in6_addr *active_addr, size_t active_len);
 
 /*
- * Destroy all current node interfaces.
+ * Add a node which is never removed for missing from discovery rounds.
  *
- * Note: This does not destroy the connections
+ * @param node address
+ */
+void node_add_static(struct in6_addr *addr);
+
+/*
+ * Destroy all current node interfaces, see node_destroy_interface.
  */
 void node_destroy_all(void);
 
 void node_rx_start(void);
 
+/*
+ * Get transmit queue statistics of a node
+ *
+ * @param interface id of the node
+ * @param statistics
+ *
+ * @return 0 if successful. Negative in case of error
+ */
+int node_tx_stats_get(uint8_t id, struct node_tx_stats *stats);
+
+/*
+ * Get traffic statistics of a node. Counters start at zero when the node is added.
+ *
+ * @param interface id of the node
+ * @param statistics
+ *
+ * @return 0 if successful. Negative in case of error
+ */
+int node_stats_get(uint8_t id, struct node_stats *stats);
+
 #endif
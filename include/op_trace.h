@@ -0,0 +1,90 @@
+/* SPDX-License-Identifier: Apache-2.0 */
+/*
+ * Copyright (c) 2023 Ayush Singh <ayushdevel1325@gmail.com>
+ */
+
+#ifndef _OP_TRACE_H_
+#define _OP_TRACE_H_
+
+#include <errno.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <greybus/greybus_messages.h>
+
+/*
+ * Hops of a Greybus message through the bridge. The numbering is part of the dump format, only
+ * append new points.
+ */
+enum op_trace_point {
+	/* Message from the AP received from the UART, see hdlc_rx_cycles() */
+	OP_TRACE_HDLC_RX,
+	/* gb_apbridge_send returned for a message from the AP */
+	OP_TRACE_AP_SUBMIT,
+	/* Message queued for a node */
+	OP_TRACE_NODE_QUEUE,
+	/* Message fully written to the node socket */
+	OP_TRACE_NODE_SEND,
+	/* Message from a node completely received */
+	OP_TRACE_NODE_RX,
+	/* Message to the AP queued for HDLC transmission */
+	OP_TRACE_HDLC_TX,
+};
+
+#ifdef CONFIG_BEAGLEPLAY_OP_TRACE
+/*
+ * Record a trace point of a Greybus message. Lock-free and safe to call from ISR.
+ *
+ * @param trace point
+ * @param interface id the message is received from or sent to
+ * @param cport_id on that interface
+ * @param Greybus message header
+ */
+void op_trace_record(enum op_trace_point point, uint8_t intf_id, uint16_t cport_id,
+		     const struct gb_operation_msg_hdr *hdr);
+
+/*
+ * Record a trace point of a Greybus message which was passed earlier. Lock-free and safe to call
+ * from ISR.
+ *
+ * @param trace point
+ * @param cycle counter at which the trace point was passed
+ * @param interface id the message is received from or sent to
+ * @param cport_id on that interface
+ * @param Greybus message header
+ */
+void op_trace_record_at(enum op_trace_point point, uint32_t cycles, uint8_t intf_id,
+			uint16_t cport_id, const struct gb_operation_msg_hdr *hdr);
+
+/*
+ * Serialize trace records, oldest first. The output starts with the cycle counter frequency
+ * (uint32_t), the sequence number to continue the next dump from (uint32_t) and the number of
+ * records (uint8_t). Each record is its sequence number and cycle count (uint32_t), cport and
+ * operation id (uint16_t), followed by trace point, interface id and message type (uint8_t). All
+ * values are little endian.
+ *
+ * @param sequence number of the first record to return. Older records are skipped
+ * @param output buffer
+ * @param size of output buffer
+ *
+ * @return number of bytes written. Negative in case of error
+ */
+int op_trace_dump(uint32_t seq, uint8_t *buffer, size_t len);
+#else
+static inline void op_trace_record(enum op_trace_point point, uint8_t intf_id, uint16_t cport_id,
+				   const struct gb_operation_msg_hdr *hdr)
+{
+}
+
+static inline void op_trace_record_at(enum op_trace_point point, uint32_t cycles,
+				      uint8_t intf_id, uint16_t cport_id,
+				      const struct gb_operation_msg_hdr *hdr)
+{
+}
+
+static inline int op_trace_dump(uint32_t seq, uint8_t *buffer, size_t len)
+{
+	return -ENOTSUP;
+}
+#endif
+
+#endif
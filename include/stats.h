@@ -0,0 +1,125 @@
+/* SPDX-License-Identifier: Apache-2.0 */
+/*
+ * Copyright (c) 2023 Ayush Singh <ayushdevel1325@gmail.com>
+ */
+
+#ifndef _STATS_H_
+#define _STATS_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Number of log2 buckets of a latency histogram */
+#define STATS_LATENCY_BUCKETS 16
+
+/*
+ * Global counters. The numbering is part of the snapshot format, only append new counters.
+ */
+enum stats_counter {
+	/* Valid HDLC frames received */
+	STATS_HDLC_RX_FRAMES,
+	/* Raw bytes received from the UART */
+	STATS_HDLC_RX_BYTES,
+	STATS_HDLC_RX_CRC_ERRORS,
+	STATS_HDLC_RX_ESCAPES,
+	/* Frames larger than HDLC_MAX_BLOCK_SIZE */
+	STATS_HDLC_RX_OVERFLOWS,
+	/* Frames rejected by the frame callback */
+	STATS_HDLC_RX_DROPPED,
+	/* UART receive interrupts finding the receive ring full */
+	STATS_HDLC_RX_RING_FULL,
+	STATS_HDLC_RX_RING_MAX,
+	STATS_HDLC_TX_FRAMES,
+	/* Encoded bytes queued for transmission */
+	STATS_HDLC_TX_BYTES,
+	STATS_HDLC_TX_ESCAPES,
+	/* Frames dropped because the transmit ring stayed full */
+	STATS_HDLC_TX_DROPPED,
+	STATS_HDLC_TX_RING_MAX,
+	/* Greybus messages which could not be allocated */
+	STATS_GB_ALLOC_FAILURES,
+	/* Greybus messages from nodes the apbridge did not accept */
+	STATS_AP_SEND_FAILURES,
+	STATS_COUNTER_COUNT,
+};
+
+/*
+ * Pipeline stages with a latency histogram. Bucket 0 counts samples below 1us, bucket n samples
+ * in [2^(n-1), 2^n) us. The last bucket also counts everything above.
+ */
+enum stats_latency {
+	/* Handling of a received HDLC frame by the frame callback */
+	STATS_LATENCY_HDLC_RX,
+	/* Wait for space in the HDLC transmit ring */
+	STATS_LATENCY_HDLC_TX_WAIT,
+	/* Time a message spends in the transmit queue of a node */
+	STATS_LATENCY_NODE_TX_QUEUE,
+	/* Handoff of a message received from a node to the apbridge */
+	STATS_LATENCY_NODE_RX,
+	STATS_LATENCY_COUNT,
+};
+
+/*
+ * Sections of a statistics snapshot. A response starts with the section, the index and the number
+ * of records, followed by the records. All values are little endian.
+ */
+enum stats_section {
+	/* index: first counter. Records: uint32_t counter values */
+	STATS_SECTION_COUNTERS,
+	/* index: stage. Records: uint32_t bucket counts */
+	STATS_SECTION_LATENCY,
+	/*
+	 * index: first interface id. Records: uint8_t id followed by uint32_t rx_msgs, rx_bytes,
+	 * tx_msgs, tx_bytes, errors and reconnects. No records once all nodes have been returned.
+	 */
+	STATS_SECTION_NODES,
+	/* index: size class. Record: struct msg_pool_stats without padding */
+	STATS_SECTION_MSG_POOL,
+	/* index: transmit class. Record: struct hdlc_tx_stats */
+	STATS_SECTION_HDLC_TX,
+};
+
+/*
+ * Increment a counter. Lock-free and safe to call from ISR.
+ *
+ * @param counter
+ */
+void stats_inc(enum stats_counter counter);
+
+/*
+ * Add to a counter. Lock-free and safe to call from ISR.
+ *
+ * @param counter
+ * @param value to add
+ */
+void stats_add(enum stats_counter counter, uint32_t value);
+
+/*
+ * Raise a high-water mark counter. Lock-free and safe to call from ISR.
+ *
+ * @param counter
+ * @param current value
+ */
+void stats_max(enum stats_counter counter, uint32_t value);
+
+/*
+ * Record a latency sample. Lock-free and safe to call from ISR.
+ *
+ * @param stage
+ * @param start of the measured interval as returned by k_cycle_get_32()
+ */
+void stats_latency_record(enum stats_latency stage, uint32_t start);
+
+/*
+ * Serialize a section of the statistics
+ *
+ * @param section
+ * @param index within the section
+ * @param output buffer
+ * @param size of output buffer
+ *
+ * @return number of bytes written. Negative in case of error
+ */
+int stats_snapshot(uint8_t section, uint8_t index, uint8_t *buffer, size_t len);
+
+#endif
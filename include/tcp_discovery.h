@@ -6,6 +6,7 @@
 #ifndef _TCP_DISCOVERY_H_
 #define _TCP_DISCOVERY_H_
 
+/* Timeout of a single discovery query in milliseconds */
 #define NODE_DISCOVERY_INTERVAL 5000
 
 /*
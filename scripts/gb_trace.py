@@ -0,0 +1,192 @@
+#!/usr/bin/env python3
+# SPDX-License-Identifier: Apache-2.0
+"""Rebuild per-operation Greybus latency breakdowns from the firmware trace ring.
+
+The firmware must be built with CONFIG_BEAGLEPLAY_OP_TRACE=y. Records are fetched with the
+CONTROL_TRACE command over the HDLC UART, so the gb-beagleplay driver must not be bound to it
+while this script runs. Records can also be saved to and loaded from a CSV file.
+
+Each operation is rebuilt from the records sharing its operation id and request type. For every
+pair of consecutive hops the latency distribution is printed, along with the end to end latency.
+"""
+
+import argparse
+import csv
+import struct
+import sys
+import time
+from collections import defaultdict
+
+ADDRESS_CONTROL = 0x03
+CONTROL_TRACE = 0x04
+HDLC_FRAME = 0x7E
+HDLC_ESC = 0x7D
+
+POINTS = ["hdlc_rx", "ap_submit", "node_queue", "node_send", "node_rx", "hdlc_tx"]
+
+DUMP_HDR = struct.Struct("<IIB")
+RECORD = struct.Struct("<IIHHBBB")
+FIELDS = ["seq", "cycles", "cport", "operation_id", "point", "intf", "type"]
+
+
+def crc16(data, crc=0xFFFF):
+    for byte in data:
+        crc ^= byte
+        for _ in range(8):
+            crc = (crc >> 1) ^ 0x8408 if crc & 1 else crc >> 1
+    return crc
+
+
+def hdlc_encode(address, control, payload):
+    body = bytes([address, control]) + payload
+    body += struct.pack("<H", crc16(body) ^ 0xFFFF)
+    out = bytearray([HDLC_FRAME])
+    for byte in body:
+        if byte in (HDLC_FRAME, HDLC_ESC):
+            out += bytes([HDLC_ESC, byte ^ 0x20])
+        else:
+            out.append(byte)
+    out.append(HDLC_FRAME)
+    return bytes(out)
+
+
+class HdlcReader:
+    def __init__(self, port):
+        self.port = port
+        self.frame = bytearray()
+        self.escaped = False
+
+    def frames(self, timeout):
+        """Yield (address, payload) of valid frames until timeout seconds pass without one."""
+        deadline = time.monotonic() + timeout
+        while time.monotonic() < deadline:
+            for byte in self.port.read(self.port.in_waiting or 1):
+                if byte == HDLC_FRAME:
+                    frame, self.frame = bytes(self.frame), bytearray()
+                    if len(frame) > 4 and crc16(frame) == 0xF0B8:
+                        deadline = time.monotonic() + timeout
+                        yield frame[0], frame[2:-2]
+                elif byte == HDLC_ESC:
+                    self.escaped = True
+                else:
+                    self.frame.append(byte ^ 0x20 if self.escaped else byte)
+                    self.escaped = False
+
+
+def fetch(device, baudrate, timeout):
+    import serial
+
+    records = []
+    hz = None
+    seq = 0
+    with serial.Serial(device, baudrate, timeout=0.05) as port:
+        reader = HdlcReader(port)
+        while True:
+            request = bytes([CONTROL_TRACE]) + struct.pack("<I", seq)
+            port.write(hdlc_encode(ADDRESS_CONTROL, 0x03, request))
+            for address, payload in reader.frames(timeout):
+                if address == ADDRESS_CONTROL and payload[:1] == bytes([CONTROL_TRACE]):
+                    break
+            else:
+                sys.exit("No trace response, is CONFIG_BEAGLEPLAY_OP_TRACE enabled?")
+
+            hz, seq, count = DUMP_HDR.unpack_from(payload, 1)
+            for i in range(count):
+                records.append(RECORD.unpack_from(payload, 1 + DUMP_HDR.size + i * RECORD.size))
+            if count == 0:
+                return hz, records
+
+
+def save(path, hz, records):
+    with open(path, "w", newline="") as f:
+        writer = csv.writer(f)
+        writer.writerow(["hz", hz])
+        writer.writerow(FIELDS)
+        writer.writerows(records)
+
+
+def load(path):
+    with open(path, newline="") as f:
+        reader = csv.reader(f)
+        hz = int(next(reader)[1])
+        next(reader)
+        return hz, [tuple(int(v) for v in row) for row in reader]
+
+
+def operations(records):
+    """Group records into operations keyed by operation id and request type."""
+    open_ops = {}
+    done = []
+    for rec in sorted(records):
+        r = dict(zip(FIELDS, rec))
+        key = (r["operation_id"], r["type"] & 0x7F)
+        op = open_ops.get(key)
+        # A request entering from the AP or a node starts a new operation once the previous one
+        # got its response. Unidirectional operations all use id 0 and never get one.
+        starts = not r["type"] & 0x80 and r["point"] in (0, 4)
+        if op is None or (starts and (op[-1]["type"] & 0x80 or r["operation_id"] == 0)):
+            if op:
+                done.append(op)
+            op = open_ops[key] = []
+        op.append(r)
+    return done + list(open_ops.values())
+
+
+def hop_name(r):
+    kind = "rsp" if r["type"] & 0x80 else "req"
+    point = POINTS[r["point"]] if r["point"] < len(POINTS) else str(r["point"])
+    return f"{point}({kind})"
+
+
+def percentile(values, pct):
+    return values[min(len(values) - 1, int(len(values) * pct / 100))]
+
+
+def report(hz, records):
+    hops = defaultdict(list)
+    total = defaultdict(list)
+
+    for op in operations(records):
+        if len(op) < 2:
+            continue
+        for a, b in zip(op, op[1:]):
+            delta = (b["cycles"] - a["cycles"]) & 0xFFFFFFFF
+            hops[(hop_name(a), hop_name(b))].append(delta / hz)
+        path = f"{hop_name(op[0])} -> {hop_name(op[-1])}"
+        total[path].append(((op[-1]["cycles"] - op[0]["cycles"]) & 0xFFFFFFFF) / hz)
+
+    def table(title, rows):
+        print(f"\n{title}")
+        print(f"{'':44} {'count':>7} {'p50 us':>9} {'p90 us':>9} {'p99 us':>9} {'max us':>9}")
+        for name, values in sorted(rows.items(), key=lambda kv: -len(kv[1])):
+            values.sort()
+            stats = [percentile(values, p) * 1e6 for p in (50, 90, 99)] + [values[-1] * 1e6]
+            print(f"{name:44} {len(values):7} " + " ".join(f"{v:9.0f}" for v in stats))
+
+    table("Per hop", {f"{a} -> {b}": v for (a, b), v in hops.items()})
+    table("End to end", total)
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("-d", "--device", default="/dev/ttyS1", help="HDLC UART of the CC1352")
+    parser.add_argument("-b", "--baudrate", type=int, default=115200)
+    parser.add_argument("-t", "--timeout", type=float, default=1.0,
+                        help="seconds to wait for a response")
+    parser.add_argument("--save", metavar="CSV", help="save fetched records")
+    parser.add_argument("--load", metavar="CSV", help="analyze saved records instead of fetching")
+    args = parser.parse_args()
+
+    if args.load:
+        hz, records = load(args.load)
+    else:
+        hz, records = fetch(args.device, args.baudrate, args.timeout)
+        if args.save:
+            save(args.save, hz, records)
+
+    print(f"{len(records)} records, cycle counter at {hz} Hz")
+    report(hz, records)
+
+
+if __name__ == "__main__":
+    main()
@@ -5,6 +5,8 @@
 
 #include "ap.h"
 #include "hdlc.h"
+#include "msg_pool.h"
+#include "op_trace.h"
 #include <zephyr/kernel.h>
 #include <zephyr/logging/log.h>
 
@@ -13,7 +15,8 @@ LOG_MODULE_DECLARE(cc1352_greybus, CONFIG_BEAGLEPLAY_GREYBUS_LOG_LEVEL);
 static int ap_send(struct gb_interface *intf, struct gb_message *msg, uint16_t cport) {
 
 	int ret = gb_message_hdlc_send(msg, cport);
-	gb_message_dealloc(msg);
+	op_trace_record(OP_TRACE_HDLC_TX, AP_INF_ID, cport, &msg->header);
+	msg_pool_free(msg);
 
 	return ret;
 }
@@ -0,0 +1,146 @@
+// SPDX-License-Identifier: Apache-2.0
+/*
+ * Copyright (c) 2023 Ayush Singh <ayushdevel1325@gmail.com>
+ */
+
+#include "flow_control.h"
+#include "hdlc.h"
+#include <errno.h>
+#include <zephyr/kernel.h>
+#include <zephyr/logging/log.h>
+#include <zephyr/sys/atomic.h>
+#include <zephyr/sys/util.h>
+
+/*
+ * Control command sent to the AP, next to the CONTROL_* commands received in main.c. It is
+ * followed by records of an interface id and the number of credits granted (uint8_t each).
+ */
+#define CONTROL_CREDITS 0x05
+/* Delay before credits which could not be sent are tried again */
+#define FLOW_CONTROL_RETRY_MS 100
+
+LOG_MODULE_DECLARE(cc1352_greybus, CONFIG_BEAGLEPLAY_GREYBUS_LOG_LEVEL);
+
+static void flow_control_handler(struct k_work *work);
+
+static K_WORK_DELAYABLE_DEFINE(flow_control_work, flow_control_handler);
+/* Credits granted but not sent yet, per interface id */
+static atomic_t flow_control_credits[UINT8_MAX + 1];
+static ATOMIC_DEFINE(flow_control_pending, UINT8_MAX + 1);
+/* Bumped by flow_control_forget, so credits of a forgotten interface are not put back */
+static uint8_t flow_control_gen[UINT8_MAX + 1];
+/* Serializes flow_control_forget against putting back credits which could not be sent */
+static struct k_spinlock flow_control_lock;
+
+static void flow_control_add(uint8_t intf_id, atomic_val_t credits)
+{
+	atomic_add(&flow_control_credits[intf_id], credits);
+	atomic_set_bit(flow_control_pending, intf_id);
+}
+
+void flow_control_grant(uint8_t intf_id, uint16_t credits)
+{
+	if (!credits) {
+		return;
+	}
+
+	flow_control_add(intf_id, credits);
+	k_work_reschedule(&flow_control_work, K_NO_WAIT);
+}
+
+int flow_control_grant_sync(uint8_t intf_id, uint8_t credits)
+{
+	const uint8_t frame[] = {CONTROL_CREDITS, intf_id, credits};
+	int ret;
+
+	ret = hdlc_block_send_try(frame, sizeof(frame), ADDRESS_CONTROL, 0x03);
+	if (ret < 0 && ret != -EAGAIN) {
+		LOG_ERR("Failed to send flow control credits of %u (%d)", intf_id, ret);
+	}
+
+	return ret;
+}
+
+void flow_control_forget(uint8_t intf_id)
+{
+	k_spinlock_key_t key = k_spin_lock(&flow_control_lock);
+
+	flow_control_gen[intf_id]++;
+	atomic_clear_bit(flow_control_pending, intf_id);
+	atomic_clear(&flow_control_credits[intf_id]);
+	k_spin_unlock(&flow_control_lock, key);
+}
+
+/*
+ * Send a frame of credit records without waiting, as this runs on the system work queue. Credits
+ * which cannot be sent are put back and retried later, since lost credits would stall the
+ * interface on the AP side until it resets the link.
+ *
+ * @param frame
+ * @param frame length
+ * @param generation of each interface in the frame when its credits were taken
+ */
+static void flow_control_send(const uint8_t *frame, size_t len, const uint8_t *gens)
+{
+	k_spinlock_key_t key;
+	size_t i;
+
+	if (hdlc_block_send_try(frame, len, ADDRESS_CONTROL, 0x03) == 0) {
+		return;
+	}
+
+	LOG_DBG("TX ring full, retrying flow control credits");
+
+	key = k_spin_lock(&flow_control_lock);
+	for (i = 1; i + 1 < len; i += 2) {
+		if (gens[i / 2] == flow_control_gen[frame[i]]) {
+			flow_control_add(frame[i], frame[i + 1]);
+		}
+	}
+	k_spin_unlock(&flow_control_lock, key);
+
+	k_work_schedule(&flow_control_work, K_MSEC(FLOW_CONTROL_RETRY_MS));
+}
+
+static void flow_control_handler(struct k_work *work)
+{
+	/* Only used by this handler, which never runs concurrently with itself */
+	static uint8_t frame[HDLC_MAX_BLOCK_SIZE];
+	static uint8_t gens[HDLC_MAX_BLOCK_SIZE / 2];
+	atomic_val_t credits;
+	k_spinlock_key_t key;
+	size_t id, len = 1;
+	uint8_t gen;
+
+	ARG_UNUSED(work);
+
+	frame[0] = CONTROL_CREDITS;
+
+	for (id = 0; id <= UINT8_MAX; ++id) {
+		if (!atomic_test_and_clear_bit(flow_control_pending, id)) {
+			continue;
+		}
+
+		key = k_spin_lock(&flow_control_lock);
+		credits = atomic_clear(&flow_control_credits[id]);
+		gen = flow_control_gen[id];
+		k_spin_unlock(&flow_control_lock, key);
+
+		/* Whatever does not fit in a record is granted by the next one */
+		while (credits > 0) {
+			if (len + 2 > sizeof(frame)) {
+				flow_control_send(frame, len, gens);
+				len = 1;
+			}
+
+			gens[len / 2] = gen;
+			frame[len++] = id;
+			frame[len++] = MIN(credits, UINT8_MAX);
+			credits -= MIN(credits, UINT8_MAX);
+		}
+	}
+
+	if (len > 1) {
+		flow_control_send(frame, len, gens);
+	}
+}
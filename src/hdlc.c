@@ -7,130 +7,618 @@
  */
 
 #include "hdlc.h"
+#include "stats.h"
 #include <string.h>
 #include <zephyr/drivers/uart.h>
 #include <zephyr/kernel.h>
 #include <zephyr/logging/log.h>
-#include <zephyr/sys/crc.h>
+#include <zephyr/sys/__assert.h>
+#include <zephyr/sys/byteorder.h>
 #include <zephyr/sys/ring_buffer.h>
 #include <greybus/greybus_protocols.h>
 
-#define HDLC_RX_BUF_SIZE 1024
+#define HDLC_RX_BUF_SIZE CONFIG_BEAGLEPLAY_HDLC_RX_BUF_SIZE
+#define HDLC_TX_BUF_SIZE CONFIG_BEAGLEPLAY_HDLC_TX_BUF_SIZE
+#define HDLC_TX_DEBUG_BUF_SIZE CONFIG_BEAGLEPLAY_HDLC_TX_DEBUG_BUF_SIZE
 
-#define HDLC_FRAME     0x7E
-#define HDLC_ESC       0x7D
-#define HDLC_ESC_FRAME 0x5E
-#define HDLC_ESC_ESC   0x5D
+#define HDLC_RX_WORKQUEUE_STACK_SIZE CONFIG_BEAGLEPLAY_HDLC_RX_WORKQUEUE_STACK_SIZE
+#define HDLC_RX_WORKQUEUE_PRIORITY   CONFIG_BEAGLEPLAY_HDLC_RX_WORKQUEUE_PRIORITY
 
-#define HDLC_RX_WORKQUEUE_STACK_SIZE 2048
-#define HDLC_RX_WORKQUEUE_PRIORITY   5
+BUILD_ASSERT(HDLC_TX_BUF_SIZE >= HDLC_ENCODED_MAX_LEN(HDLC_MAX_BLOCK_SIZE),
+	     "HDLC TX ring cannot hold a maximum size frame");
+BUILD_ASSERT(HDLC_TX_DEBUG_BUF_SIZE >= HDLC_ENCODED_MAX_LEN(HDLC_MAX_BLOCK_SIZE),
+	     "HDLC debug TX ring cannot hold a maximum size frame");
+
+#define HDLC_SEQ_MASK     0x07
+#define HDLC_CTRL_S_FRAME 0x01
+
+/* Supervisory frame types */
+#define HDLC_S_RR   0x00
+#define HDLC_S_RNR  0x01
+#define HDLC_S_REJ  0x02
+#define HDLC_S_SREJ 0x03
 
 static void hdlc_rx_handler(struct k_work *);
 
 LOG_MODULE_DECLARE(cc1352_greybus, CONFIG_BEAGLEPLAY_GREYBUS_LOG_LEVEL);
 
 K_WORK_DEFINE(hdlc_rx_work, hdlc_rx_handler);
+static K_THREAD_STACK_DEFINE(hdlc_rx_workq_stack, HDLC_RX_WORKQUEUE_STACK_SIZE);
 RING_BUF_DECLARE(hdlc_rx_ringbuf, HDLC_RX_BUF_SIZE);
+RING_BUF_DECLARE(hdlc_tx_ringbuf, HDLC_TX_BUF_SIZE);
+RING_BUF_DECLARE(hdlc_tx_debug_ringbuf, HDLC_TX_DEBUG_BUF_SIZE);
+
+/*
+ * Serialize producers of hdlc_tx_ringbuf and hdlc_tx_debug_ringbuf respectively. The consumer of
+ * both is the transport TX ISR, which picks whole frames through hdlc_tx_start.
+ */
+static K_MUTEX_DEFINE(hdlc_tx_lock);
+static K_MUTEX_DEFINE(hdlc_tx_debug_lock);
+/* Given by the consumer whenever space is freed in the respective ring */
+static K_SEM_DEFINE(hdlc_tx_space, 0, 1);
+static K_SEM_DEFINE(hdlc_tx_debug_space, 0, 1);
+/* Protects hdlc_sync_frame after a panic. Before, hdlc_tx_lock and hdlc_tx_debug_lock do */
+static struct k_spinlock hdlc_sync_lock;
+static bool hdlc_panic_mode;
+
+/**
+ * struct hdlc_tx_ring - Transmit ring of whole encoded frames of one class
+ *
+ * @ringbuf: encoded frames
+ * @lock: serializes producers, including the use of @frame
+ * @space: given by the consumer whenever space is freed in @ringbuf
+ * @frame: staging buffer the next frame is encoded into
+ * @in_frame: a frame has been partially transmitted. Only accessed by the consumer
+ * @claim_closes: the outstanding claim ends with a closing flag. Only accessed by the consumer
+ * @claimed: length of the outstanding claim. Only accessed by the consumer
+ * @stats: transmit statistics. Updated by producers with @lock held
+ */
+struct hdlc_tx_ring {
+	struct ring_buf *ringbuf;
+	struct k_mutex *lock;
+	struct k_sem *space;
+	uint8_t *frame;
+	bool in_frame;
+	bool claim_closes;
+	uint32_t claimed;
+	struct hdlc_tx_stats stats;
+};
 
 struct hdlc_driver {
 	hdlc_process_frame_callback process_callback_frame_cb;
 	hdlc_send_frame_callback send_frame_cb;
+	hdlc_tx_notify_callback tx_notify_cb;
 
-	uint16_t crc;
-	bool next_escaped;
+	struct hdlc_deframer rx;
+	/* hdlc_rx_last_cycles when the data being processed was claimed */
+	uint32_t rx_cycles;
 	uint8_t rx_send_seq;
 	uint8_t send_seq;
-	uint16_t rx_buffer_len;
-	uint8_t rx_buffer[HDLC_MAX_BLOCK_SIZE];
+#ifdef CONFIG_BEAGLEPLAY_HDLC_RELIABLE
+	uint8_t recv_seq;
+	uint8_t win_head;
+	bool rej_sent;
+	bool ack_pending;
+#endif
 };
 
 static struct hdlc_driver hdlc_driver;
+/* Cycle counter of the latest hdlc_rx_finish */
+static atomic_t hdlc_rx_last_cycles;
+/* hdlc_rx_start found the ring full, the transport waits for hdlc_rx_resume_cb */
+static atomic_t hdlc_rx_paused;
+static hdlc_rx_resume_callback hdlc_rx_resume_cb;
+/* Kept outside hdlc_driver since it may be set before hdlc_init */
+static hdlc_tx_notify_callback hdlc_tx_idle_cb;
+static struct k_work_q hdlc_rx_workq;
+
+#ifdef CONFIG_BEAGLEPLAY_HDLC_RELIABLE
+#define HDLC_WINDOW_SIZE CONFIG_BEAGLEPLAY_HDLC_WINDOW_SIZE
+
+/**
+ * struct hdlc_tx_slot - Unacknowledged I-frame payload kept for retransmission
+ *
+ * @len: payload length
+ * @buffer: payload
+ */
+struct hdlc_tx_slot {
+	uint16_t len;
+	uint8_t buffer[HDLC_MAX_BLOCK_SIZE];
+};
+
+static void hdlc_retransmit_handler(struct k_work *);
+
+/* Ring of HDLC_WINDOW_SIZE slots. win_head holds the frame with N(S) == rx_send_seq */
+static struct hdlc_tx_slot hdlc_tx_window[HDLC_WINDOW_SIZE];
+static K_SEM_DEFINE(hdlc_window_sem, HDLC_WINDOW_SIZE, HDLC_WINDOW_SIZE);
+static K_WORK_DELAYABLE_DEFINE(hdlc_retransmit_work, hdlc_retransmit_handler);
+#endif
+
+#ifdef CONFIG_BEAGLEPLAY_HDLC_GREYBUS_AGGREGATE
+static void hdlc_gb_aggregate_handler(struct k_work *);
+
+/* Pending aggregated Greybus frame, starting with HDLC_GREYBUS_CPORT_AGGREGATE */
+static uint8_t hdlc_gb_aggregate_buf[HDLC_MAX_BLOCK_SIZE];
+static size_t hdlc_gb_aggregate_len;
+static size_t hdlc_gb_aggregate_count;
+static K_MUTEX_DEFINE(hdlc_gb_aggregate_lock);
+static K_WORK_DELAYABLE_DEFINE(hdlc_gb_aggregate_work, hdlc_gb_aggregate_handler);
+#endif
+
+#ifdef CONFIG_BEAGLEPLAY_HDLC_GREYBUS_FRAGMENT
+#define HDLC_GB_FRAGMENT_HDR_LEN (sizeof(uint16_t) + sizeof(uint8_t))
+
+/* Fragments of different messages must not interleave */
+static K_MUTEX_DEFINE(hdlc_gb_fragment_lock);
+#endif
+
+/* Encoded frame staging buffers. Protected by the lock of their ring, see hdlc_block_send_sync */
+static uint8_t hdlc_tx_frame[HDLC_ENCODED_MAX_LEN(HDLC_MAX_BLOCK_SIZE)];
+static uint8_t hdlc_tx_debug_frame[HDLC_ENCODED_MAX_LEN(HDLC_MAX_BLOCK_SIZE)];
+static uint8_t hdlc_sync_frame[HDLC_ENCODED_MAX_LEN(HDLC_MAX_BLOCK_SIZE)];
+
+/* Indexed by enum hdlc_tx_class, in order of priority */
+static struct hdlc_tx_ring hdlc_tx_rings[HDLC_TX_CLASS_COUNT] = {
+	[HDLC_TX_CLASS_GREYBUS] = {
+		.ringbuf = &hdlc_tx_ringbuf,
+		.lock = &hdlc_tx_lock,
+		.space = &hdlc_tx_space,
+		.frame = hdlc_tx_frame,
+	},
+	[HDLC_TX_CLASS_DEBUG] = {
+		.ringbuf = &hdlc_tx_debug_ringbuf,
+		.lock = &hdlc_tx_debug_lock,
+		.space = &hdlc_tx_debug_space,
+		.frame = hdlc_tx_debug_frame,
+	},
+};
+
+/* Ring of the outstanding hdlc_tx_start claim. Only accessed by the consumer */
+static struct hdlc_tx_ring *hdlc_tx_current;
+
+/* Account an encoded frame of len bytes carrying payload_len bytes */
+static void hdlc_tx_stats_count(size_t len, size_t payload_len)
+{
+	stats_inc(STATS_HDLC_TX_FRAMES);
+	stats_add(STATS_HDLC_TX_BYTES, len);
+	/* Flags, address, control and CRC take 6 bytes before escaping */
+	stats_add(STATS_HDLC_TX_ESCAPES, len - payload_len - 6);
+}
+
+static uint8_t hdlc_control(uint8_t control)
+{
+	return (control == 0) ? hdlc_driver.send_seq << 1 : control;
+}
+
+static struct hdlc_tx_ring *hdlc_tx_ring_get(uint8_t address)
+{
+	/* Control frames share the Greybus ring so they keep their order relative to it */
+	return &hdlc_tx_rings[(address == ADDRESS_DBG) ? HDLC_TX_CLASS_DEBUG
+							 : HDLC_TX_CLASS_GREYBUS];
+}
+
+/* Account a frame dropped because its ring stayed full */
+static void hdlc_tx_drop(struct hdlc_tx_ring *ring)
+{
+	ring->stats.dropped++;
+	stats_inc(STATS_HDLC_TX_DROPPED);
+	LOG_ERR("HDLC TX ring full");
+}
+
+/*
+ * Encode a frame and queue it in the TX ring of its class without waiting. Must be called with
+ * the lock of that ring held.
+ *
+ * @return 0 on success, -ENOBUFS if the ring does not have room for the whole frame
+ */
+static int hdlc_tx_queue(const struct hdlc_iovec *iov, size_t iovcnt, uint8_t address,
+			 uint8_t control)
+{
+	struct hdlc_tx_ring *ring = hdlc_tx_ring_get(address);
+	uint32_t used;
+	size_t len;
+
+	len = hdlc_frame_encode(ring->frame, iov, iovcnt, address, control);
+
+	/* Only queue whole frames */
+	if (ring_buf_space_get(ring->ringbuf) < len) {
+		return -ENOBUFS;
+	}
+
+	ring_buf_put(ring->ringbuf, ring->frame, len);
+
+	ring->stats.frames++;
+	ring->stats.bytes += len;
+	used = ring_buf_size_get(ring->ringbuf);
+	if (used > ring->stats.max_used) {
+		ring->stats.max_used = used;
+	}
+
+	hdlc_tx_stats_count(len, hdlc_iov_len(iov, iovcnt));
+	stats_max(STATS_HDLC_TX_RING_MAX, used);
+
+	return 0;
+}
+
+/**
+ * struct hdlc_tx_args - Frame queued through hdlc_tx_queue_wait()
+ *
+ * @iov: payload
+ * @iovcnt: number of elements in @iov
+ * @address: HDLC address
+ * @control: HDLC control, passed through hdlc_control()
+ */
+struct hdlc_tx_args {
+	const struct hdlc_iovec *iov;
+	size_t iovcnt;
+	uint8_t address;
+	uint8_t control;
+};
+
+/* Queue a frame with the ring lock held. Returns -ENOBUFS to wait for ring space */
+typedef int (*hdlc_tx_queue_callback)(const struct hdlc_tx_args *args);
+
+static int hdlc_tx_queue_args(const struct hdlc_tx_args *args)
+{
+	return hdlc_tx_queue(args->iov, args->iovcnt, args->address, hdlc_control(args->control));
+}
+
+/*
+ * Queue a frame, waiting up to timeout for ring space. The ring lock is released while waiting
+ * so that other producers, in particular acknowledgements and resends from hdlc_rx_workq, are not
+ * held up. The frame is encoded again after every wait since sequence numbers may have moved on.
+ * Callers which do not wait retry on their own, so their failures are not counted as drops.
+ */
+static int hdlc_tx_queue_wait(const struct hdlc_tx_args *args, hdlc_tx_queue_callback queue,
+			      k_timeout_t timeout)
+{
+	struct hdlc_tx_ring *ring = hdlc_tx_ring_get(args->address);
+	k_timepoint_t end = sys_timepoint_calc(timeout);
+	uint32_t start = k_cycle_get_32();
+	int ret;
+
+	for (;;) {
+		k_mutex_lock(ring->lock, K_FOREVER);
+		ret = queue(args);
+		k_mutex_unlock(ring->lock);
+
+		if (ret != -ENOBUFS) {
+			break;
+		}
+
+		if (k_sem_take(ring->space, sys_timepoint_timeout(end)) < 0) {
+			if (!K_TIMEOUT_EQ(timeout, K_NO_WAIT)) {
+				k_mutex_lock(ring->lock, K_FOREVER);
+				hdlc_tx_drop(ring);
+				k_mutex_unlock(ring->lock);
+			}
+			ret = -EAGAIN;
+			break;
+		}
+	}
+
+	stats_latency_record(STATS_LATENCY_HDLC_TX_WAIT, start);
+
+	if (ret == 0) {
+		hdlc_driver.tx_notify_cb();
+	}
+
+	return ret;
+}
+
+#ifdef CONFIG_BEAGLEPLAY_HDLC_RELIABLE
+/*
+ * The sequence state below is shared between hdlc_rx_workq and the sending threads. Everything
+ * that reads or writes it must hold hdlc_tx_lock.
+ */
+
+static inline uint8_t hdlc_i_control(uint8_t ns)
+{
+	return (hdlc_driver.recv_seq << 5) | (ns << 1);
+}
+
+static inline uint8_t hdlc_s_control(uint8_t type)
+{
+	return (hdlc_driver.recv_seq << 5) | (type << 2) | HDLC_CTRL_S_FRAME;
+}
+
+static inline uint8_t hdlc_window_outstanding(void)
+{
+	return (hdlc_driver.send_seq - hdlc_driver.rx_send_seq) & HDLC_SEQ_MASK;
+}
+
+static struct hdlc_tx_slot *hdlc_window_slot(uint8_t seq)
+{
+	uint8_t offset = (seq - hdlc_driver.rx_send_seq) & HDLC_SEQ_MASK;
+
+	return &hdlc_tx_window[(hdlc_driver.win_head + offset) % HDLC_WINDOW_SIZE];
+}
+
+static void hdlc_retransmit_schedule(void)
+{
+	k_work_reschedule_for_queue(&hdlc_rx_workq, &hdlc_retransmit_work,
+				    K_MSEC(CONFIG_BEAGLEPLAY_HDLC_RETRANSMIT_TIMEOUT_MS));
+}
 
-static void uart_poll_out_crc(uint8_t byte, uint16_t *crc)
+/*
+ * Queue an unacknowledged I-frame again without waiting for ring space, since this runs on
+ * hdlc_rx_workq. Must be called with hdlc_tx_lock held
+ */
+static int hdlc_window_resend(uint8_t seq)
+{
+	struct hdlc_tx_slot *slot = hdlc_window_slot(seq);
+	const struct hdlc_iovec iov = {slot->buffer, slot->len};
+	int ret;
+
+	ret = hdlc_tx_queue(&iov, 1, ADDRESS_GREYBUS, hdlc_i_control(seq));
+	if (ret < 0) {
+		hdlc_tx_drop(&hdlc_tx_rings[HDLC_TX_CLASS_GREYBUS]);
+		return ret;
+	}
+
+	/* N(R) was piggybacked */
+	hdlc_driver.ack_pending = false;
+
+	return 0;
+}
+
+/*
+ * Go back N: resend every unacknowledged frame starting at seq. Whatever does not fit in the TX
+ * ring is left to the retransmit timer. Must be called with hdlc_tx_lock held
+ */
+static void hdlc_window_resend_from(uint8_t seq)
+{
+	for (; seq != hdlc_driver.send_seq; seq = (seq + 1) & HDLC_SEQ_MASK) {
+		if (hdlc_window_resend(seq) < 0) {
+			break;
+		}
+	}
+
+	if (hdlc_window_outstanding()) {
+		hdlc_retransmit_schedule();
+	}
+}
+
+/* Release all frames before N(R). Must be called with hdlc_tx_lock held */
+static void hdlc_window_ack(uint8_t nr)
+{
+	uint8_t acked, outstanding;
+
+	acked = (nr - hdlc_driver.rx_send_seq) & HDLC_SEQ_MASK;
+	outstanding = hdlc_window_outstanding();
+	if (acked > outstanding) {
+		LOG_WRN("Invalid HDLC N(R) %u", nr);
+		return;
+	}
+
+	hdlc_driver.rx_send_seq = nr;
+	hdlc_driver.win_head = (hdlc_driver.win_head + acked) % HDLC_WINDOW_SIZE;
+	for (uint8_t i = 0; i < acked; ++i) {
+		k_sem_give(&hdlc_window_sem);
+	}
+
+	if (acked == outstanding) {
+		k_work_cancel_delayable(&hdlc_retransmit_work);
+	} else if (acked) {
+		hdlc_retransmit_schedule();
+	}
+}
+
+/*
+ * Queue an S-frame without waiting for ring space. A dropped RR is sent again after the next
+ * received frame. Must be called with hdlc_tx_lock held
+ */
+static int hdlc_s_frame_send(uint8_t type)
 {
-	uint8_t temp;
+	int ret;
+
+	ret = hdlc_tx_queue(NULL, 0, ADDRESS_GREYBUS, hdlc_s_control(type));
+	if (ret < 0) {
+		hdlc_tx_drop(&hdlc_tx_rings[HDLC_TX_CLASS_GREYBUS]);
+		return ret;
+	}
 
-	*crc = crc16_ccitt(*crc, &byte, 1);
-	if (byte == HDLC_FRAME || byte == HDLC_ESC) {
-		temp = HDLC_ESC;
-		hdlc_driver.send_frame_cb(&temp, 1);
-		byte ^= 0x20;
+	hdlc_driver.ack_pending = false;
+
+	return 0;
+}
+
+/* Must be called with hdlc_tx_lock held */
+static void hdlc_reject(struct hdlc_driver *drv)
+{
+	/* Only one outstanding REJ, like in HDLC ABM */
+	if (!drv->rej_sent && hdlc_s_frame_send(HDLC_S_REJ) == 0) {
+		drv->rej_sent = true;
 	}
-	hdlc_driver.send_frame_cb(&byte, 1);
 }
 
+/* Copy the payload into the next window slot and queue it. Called with hdlc_tx_lock held */
+static int hdlc_i_frame_queue(const struct hdlc_tx_args *args)
+{
+	struct hdlc_tx_slot *slot = hdlc_window_slot(hdlc_driver.send_seq);
+	struct hdlc_iovec slot_iov;
+	int ret;
+
+	slot->len = 0;
+	for (size_t i = 0; i < args->iovcnt; ++i) {
+		memcpy(&slot->buffer[slot->len], args->iov[i].base, args->iov[i].len);
+		slot->len += args->iov[i].len;
+	}
+
+	slot_iov.base = slot->buffer;
+	slot_iov.len = slot->len;
+	ret = hdlc_tx_queue(&slot_iov, 1, ADDRESS_GREYBUS, hdlc_i_control(hdlc_driver.send_seq));
+	if (ret < 0) {
+		return ret;
+	}
+
+	hdlc_driver.send_seq = (hdlc_driver.send_seq + 1) & HDLC_SEQ_MASK;
+	/* N(R) was piggybacked */
+	hdlc_driver.ack_pending = false;
+	k_work_schedule_for_queue(&hdlc_rx_workq, &hdlc_retransmit_work,
+				  K_MSEC(CONFIG_BEAGLEPLAY_HDLC_RETRANSMIT_TIMEOUT_MS));
+
+	return 0;
+}
+
+static int hdlc_i_frame_send(const struct hdlc_iovec *iov, size_t iovcnt, k_timeout_t timeout)
+{
+	const struct hdlc_tx_args args = {iov, iovcnt, ADDRESS_GREYBUS, 0};
+	int ret;
+
+	/* Backpressure while the window is full. Released by acknowledgements */
+	ret = k_sem_take(&hdlc_window_sem, timeout);
+	if (ret < 0) {
+		if (!K_TIMEOUT_EQ(timeout, K_NO_WAIT)) {
+			LOG_ERR("HDLC send window full");
+		}
+		return -EAGAIN;
+	}
+
+	ret = hdlc_tx_queue_wait(&args, hdlc_i_frame_queue, timeout);
+	if (ret < 0) {
+		k_sem_give(&hdlc_window_sem);
+	}
+
+	return ret;
+}
+
+static void hdlc_retransmit_handler(struct k_work *work)
+{
+	ARG_UNUSED(work);
+
+	k_mutex_lock(&hdlc_tx_lock, K_FOREVER);
+	LOG_WRN("HDLC ack timeout, resending %u frames", hdlc_window_outstanding());
+	hdlc_window_resend_from(hdlc_driver.rx_send_seq);
+	k_mutex_unlock(&hdlc_tx_lock);
+
+	hdlc_driver.tx_notify_cb();
+}
+#endif
+
 static void hdlc_process_complete_frame(struct hdlc_driver *drv)
 {
 	int ret;
-	uint8_t address = drv->rx_buffer[0];
-	size_t len = drv->rx_buffer_len - 4;
-	void *buffer = &drv->rx_buffer[2];
+	uint8_t address = drv->rx.buffer[0];
+	size_t len = drv->rx.len - 4;
+	void *buffer = &drv->rx.buffer[2];
+	uint32_t start = k_cycle_get_32();
 
 	ret = drv->process_callback_frame_cb(buffer, len, address);
+	stats_latency_record(STATS_LATENCY_HDLC_RX, start);
 
 	if (ret < 0) {
-		LOG_ERR("Dropped HDLC addr:%x ctrl:%x", address, drv->rx_buffer[1]);
-		LOG_HEXDUMP_DBG(drv->rx_buffer, drv->rx_buffer_len, "rx_buffer");
+		stats_inc(STATS_HDLC_RX_DROPPED);
+		LOG_ERR("Dropped HDLC addr:%x ctrl:%x", address, drv->rx.buffer[1]);
+		LOG_HEXDUMP_DBG(drv->rx.buffer, drv->rx.len, "rx_buffer");
 	}
 }
 
-static void hdlc_process_frame(struct hdlc_driver *drv)
+#ifdef CONFIG_BEAGLEPLAY_HDLC_RELIABLE
+/*
+ * Go back N receiver: frames after a lost one are discarded until the peer resends from N(S)
+ * after our REJ. This needs no reordering buffer, which would cost HDLC_WINDOW_SIZE maximum size
+ * blocks of RAM for a link that loses frames rarely.
+ */
+static void hdlc_process_reliable_frame(struct hdlc_driver *drv, uint8_t ctrl)
 {
-	if (drv->rx_buffer_len > 3 && drv->crc == 0xf0b8) {
-		uint8_t ctrl = drv->rx_buffer[1];
+	uint8_t nr = (ctrl >> 5) & HDLC_SEQ_MASK;
+	bool deliver = false;
 
-		if ((ctrl & 1) == 0) {
-			drv->rx_send_seq = (ctrl >> 5) & 0x07;
+	k_mutex_lock(&hdlc_tx_lock, K_FOREVER);
+
+	if ((ctrl & 0x01) == 0) {
+		hdlc_window_ack(nr);
+
+		if (((ctrl >> 1) & HDLC_SEQ_MASK) != drv->recv_seq) {
+			hdlc_reject(drv);
 		} else {
-			hdlc_process_complete_frame(drv);
+			drv->recv_seq = (drv->recv_seq + 1) & HDLC_SEQ_MASK;
+			drv->rej_sent = false;
+			drv->ack_pending = true;
+			deliver = true;
+		}
+	} else if ((ctrl & 0x03) == HDLC_CTRL_S_FRAME) {
+		switch ((ctrl >> 2) & 0x03) {
+		case HDLC_S_RR:
+		case HDLC_S_RNR:
+			hdlc_window_ack(nr);
+			break;
+		case HDLC_S_REJ:
+			hdlc_window_ack(nr);
+			hdlc_window_resend_from(nr);
+			break;
+		case HDLC_S_SREJ:
+			if (((nr - drv->rx_send_seq) & HDLC_SEQ_MASK) < hdlc_window_outstanding()) {
+				hdlc_window_resend(nr);
+			}
+			break;
 		}
 	} else {
-		LOG_ERR("Dropped HDLC crc:%04x len:%d", drv->crc, drv->rx_buffer_len);
+		deliver = true;
 	}
 
-	drv->crc = 0xffff;
-	drv->rx_buffer_len = 0;
+	k_mutex_unlock(&hdlc_tx_lock);
+
+	drv->tx_notify_cb();
+
+	if (deliver) {
+		hdlc_process_complete_frame(drv);
+	}
 }
+#endif
 
-static int hdlc_save_byte(struct hdlc_driver *drv, uint8_t byte)
+/* Called by the deframer for every closed frame */
+static void hdlc_process_frame(struct hdlc_deframer *rx, void *user_data)
 {
-	if (drv->rx_buffer_len >= HDLC_MAX_BLOCK_SIZE) {
-		LOG_ERR("HDLC RX Buffer Overflow");
-		drv->crc = 0xffff;
-		drv->rx_buffer_len = 0;
-	}
+	struct hdlc_driver *drv = user_data;
 
-	drv->rx_buffer[drv->rx_buffer_len++] = byte;
+	if (rx->len > 3 && rx->crc == 0xf0b8) {
+		uint8_t ctrl = rx->buffer[1];
 
-	return 0;
-}
+		stats_inc(STATS_HDLC_RX_FRAMES);
 
-static void hdlc_rx_input_byte(struct hdlc_driver *drv, uint8_t byte)
-{
-	switch (byte) {
-	case HDLC_FRAME:
-		if (drv->rx_buffer_len) {
-			hdlc_process_frame(drv);
+#ifdef CONFIG_BEAGLEPLAY_HDLC_RELIABLE
+		/* Only the Greybus address is sequenced. Other addresses use unnumbered frames */
+		if (rx->buffer[0] == ADDRESS_GREYBUS) {
+			hdlc_process_reliable_frame(drv, ctrl);
+		} else {
+			hdlc_process_complete_frame(drv);
 		}
-		break;
-	case HDLC_ESC:
-		drv->next_escaped = true;
-		break;
-	default:
-		if (drv->next_escaped) {
-			byte ^= 0x20;
-			drv->next_escaped = false;
+#else
+		if ((ctrl & 1) == 0) {
+			drv->rx_send_seq = (ctrl >> 5) & 0x07;
+		} else {
+			hdlc_process_complete_frame(drv);
 		}
-		drv->crc = crc16_ccitt(drv->crc, &byte, 1);
-		hdlc_save_byte(drv, byte);
+#endif
+	} else {
+		stats_inc(STATS_HDLC_RX_CRC_ERRORS);
+		LOG_ERR("Dropped HDLC crc:%04x len:%d", rx->crc, rx->len);
+#ifdef CONFIG_BEAGLEPLAY_HDLC_RELIABLE
+		/* Ask for a resend right away instead of waiting for the peer to time out */
+		k_mutex_lock(&hdlc_tx_lock, K_FOREVER);
+		hdlc_reject(drv);
+		k_mutex_unlock(&hdlc_tx_lock);
+		drv->tx_notify_cb();
+#endif
 	}
 }
 
 static int hdlc_process_buffer(uint8_t *buf, size_t len)
 {
-	for (size_t i = 0; i < len; ++i) {
-		hdlc_rx_input_byte(&hdlc_driver, buf[i]);
+	struct hdlc_deframer *rx = &hdlc_driver.rx;
+	uint32_t escapes = rx->escapes;
+	uint32_t overflows = rx->overflows;
+
+	hdlc_deframe(rx, buf, len, hdlc_process_frame, &hdlc_driver);
+
+	stats_add(STATS_HDLC_RX_ESCAPES, rx->escapes - escapes);
+	if (rx->overflows != overflows) {
+		stats_add(STATS_HDLC_RX_OVERFLOWS, rx->overflows - overflows);
+		LOG_ERR("HDLC RX Buffer Overflow");
 	}
+
 	return len;
 }
 
@@ -139,72 +627,529 @@ static void hdlc_rx_handler(struct k_work *work)
 	ARG_UNUSED(work);
 
 	uint8_t *data;
+	uint32_t len;
 	int ret;
 
-	ret = ring_buf_get_claim(&hdlc_rx_ringbuf, &data, HDLC_RX_BUF_SIZE);
-	ret = hdlc_process_buffer(data, ret);
-	if (ret < 0) {
-		LOG_ERR("Error processing HDLC buffer");
+	/* Claims stop at the end of the ring, so loop to also pick up data that wrapped around */
+	while ((len = ring_buf_get_claim(&hdlc_rx_ringbuf, &data, HDLC_RX_BUF_SIZE)) > 0) {
+		/* Every claimed byte was received by now */
+		hdlc_driver.rx_cycles = atomic_get(&hdlc_rx_last_cycles);
+		ret = hdlc_process_buffer(data, len);
+		if (ret < 0) {
+			LOG_ERR("Error processing HDLC buffer");
+		}
+
+		ret = ring_buf_get_finish(&hdlc_rx_ringbuf, len);
+		if (ret < 0) {
+			LOG_ERR("Cannot flush ring buffer (%d)", ret);
+			return;
+		}
+
+		if (atomic_cas(&hdlc_rx_paused, 1, 0) && hdlc_rx_resume_cb) {
+			hdlc_rx_resume_cb();
+		}
 	}
 
-	ret = ring_buf_get_finish(&hdlc_rx_ringbuf, ret);
-	if (ret < 0) {
-		LOG_ERR("Cannot flush ring buffer (%d)", ret);
+#ifdef CONFIG_BEAGLEPLAY_HDLC_RELIABLE
+	/* Acknowledge the whole batch at once unless an I-frame already carried N(R) */
+	k_mutex_lock(&hdlc_tx_lock, K_FOREVER);
+	if (hdlc_driver.ack_pending) {
+		hdlc_s_frame_send(HDLC_S_RR);
 	}
+	k_mutex_unlock(&hdlc_tx_lock);
+
+	hdlc_driver.tx_notify_cb();
+#endif
 }
 
 int hdlc_block_send_sync(const uint8_t *buffer, size_t buffer_len, uint8_t address, uint8_t control)
 {
-	uint8_t temp = HDLC_FRAME;
-	uint16_t crc = 0xffff;
+	const struct hdlc_iovec iov = {buffer, buffer_len};
+	k_spinlock_key_t key;
+	int ret;
+	size_t len;
 
-	hdlc_driver.send_frame_cb(&temp, 1);
-	uart_poll_out_crc(address, &crc);
+	if (buffer_len > HDLC_MAX_BLOCK_SIZE) {
+		return -EMSGSIZE;
+	}
 
-	if (control == 0) {
-		uart_poll_out_crc(hdlc_driver.send_seq << 1, &crc);
-	} else {
-		uart_poll_out_crc(control, &crc);
+	/*
+	 * After a panic, interrupts cannot be relied upon, and masking them while the frame is
+	 * polled out is acceptable.
+	 */
+	if (hdlc_panic_mode) {
+		key = k_spin_lock(&hdlc_sync_lock);
+		len = hdlc_frame_encode(hdlc_sync_frame, &iov, 1, address, hdlc_control(control));
+		ret = hdlc_driver.send_frame_cb(hdlc_sync_frame, len);
+		k_spin_unlock(&hdlc_sync_lock, key);
+		goto out;
+	}
+
+	/*
+	 * Otherwise keep every producer out and let the TX interrupt finish what is queued, so the
+	 * polled out frame does not interleave with a frame from the rings.
+	 */
+	k_mutex_lock(&hdlc_tx_lock, K_FOREVER);
+	k_mutex_lock(&hdlc_tx_debug_lock, K_FOREVER);
+	while (!hdlc_tx_is_idle()) {
+		k_sleep(K_MSEC(1));
+	}
+
+	len = hdlc_frame_encode(hdlc_sync_frame, &iov, 1, address, hdlc_control(control));
+	ret = hdlc_driver.send_frame_cb(hdlc_sync_frame, len);
+
+	k_mutex_unlock(&hdlc_tx_debug_lock);
+	k_mutex_unlock(&hdlc_tx_lock);
+
+out:
+	hdlc_tx_stats_count(len, buffer_len);
+
+	return (ret < 0) ? ret : 0;
+}
+
+/* hdlc_block_send_iov_async() with a custom wait for ring and window space */
+static int hdlc_block_send_iov(const struct hdlc_iovec *iov, size_t iovcnt, uint8_t address,
+			       uint8_t control, k_timeout_t timeout)
+{
+	const struct hdlc_tx_args args = {iov, iovcnt, address, control};
+
+	if (hdlc_iov_len(iov, iovcnt) > HDLC_MAX_BLOCK_SIZE) {
+		return -EMSGSIZE;
 	}
 
-	for (int i = 0; i < buffer_len; i++) {
-		uart_poll_out_crc(buffer[i], &crc);
+#ifdef CONFIG_BEAGLEPLAY_HDLC_RELIABLE
+	if (address == ADDRESS_GREYBUS) {
+		return hdlc_i_frame_send(iov, iovcnt, timeout);
 	}
+#endif
+
+	return hdlc_tx_queue_wait(&args, hdlc_tx_queue_args, timeout);
+}
+
+int hdlc_block_send_iov_async(const struct hdlc_iovec *iov, size_t iovcnt, uint8_t address,
+			      uint8_t control)
+{
+	return hdlc_block_send_iov(iov, iovcnt, address, control,
+				   K_MSEC(CONFIG_BEAGLEPLAY_HDLC_TX_TIMEOUT_MS));
+}
+
+int hdlc_block_send_async(const uint8_t *buffer, size_t buffer_len, uint8_t address,
+			  uint8_t control)
+{
+	const struct hdlc_iovec iov = {buffer, buffer_len};
+
+	return hdlc_block_send_iov_async(&iov, 1, address, control);
+}
+
+int hdlc_block_send_try(const uint8_t *buffer, size_t buffer_len, uint8_t address,
+			uint8_t control)
+{
+	const struct hdlc_iovec iov = {buffer, buffer_len};
+
+	return hdlc_block_send_iov(&iov, 1, address, control, K_NO_WAIT);
+}
+
+#ifdef CONFIG_BEAGLEPLAY_HDLC_GREYBUS_AGGREGATE
+/*
+ * Send the pending aggregated frame, waiting up to timeout for room. The pending messages are
+ * kept if it cannot be sent. Must be called with hdlc_gb_aggregate_lock held
+ */
+static int hdlc_gb_aggregate_flush(k_timeout_t timeout)
+{
+	struct hdlc_iovec iov = {hdlc_gb_aggregate_buf, hdlc_gb_aggregate_len};
+	int ret;
 
-	uint16_t crc_calc = crc ^ 0xffff;
+	if (hdlc_gb_aggregate_count == 0) {
+		return 0;
+	}
 
-	uart_poll_out_crc(crc_calc, &crc);
-	uart_poll_out_crc(crc_calc >> 8, &crc);
-	hdlc_driver.send_frame_cb(&temp, 1);
+	/* A lone message does not need the aggregate header */
+	if (hdlc_gb_aggregate_count == 1) {
+		iov.base = &hdlc_gb_aggregate_buf[sizeof(uint16_t)];
+		iov.len -= sizeof(uint16_t);
+	}
+
+	ret = hdlc_block_send_iov(&iov, 1, ADDRESS_GREYBUS, 0x03, timeout);
+	if (ret < 0) {
+		return ret;
+	}
+
+	hdlc_gb_aggregate_len = 0;
+	hdlc_gb_aggregate_count = 0;
 
 	return 0;
 }
 
-int hdlc_init(hdlc_process_frame_callback process_cb, hdlc_send_frame_callback send_cb)
+static void hdlc_gb_aggregate_schedule(void)
+{
+	k_work_reschedule(&hdlc_gb_aggregate_work,
+			  K_USEC(CONFIG_BEAGLEPLAY_HDLC_GREYBUS_AGGREGATE_TIMEOUT_US));
+}
+
+/*
+ * Flush timer. Runs on the system work queue, so it never waits for the lock or for room and
+ * tries again later instead. Pending messages are only ever released by a successful send.
+ */
+static void hdlc_gb_aggregate_handler(struct k_work *work)
+{
+	ARG_UNUSED(work);
+
+	if (k_mutex_lock(&hdlc_gb_aggregate_lock, K_NO_WAIT) < 0) {
+		hdlc_gb_aggregate_schedule();
+		return;
+	}
+
+	if (hdlc_gb_aggregate_flush(K_NO_WAIT) < 0) {
+		hdlc_gb_aggregate_schedule();
+	}
+
+	k_mutex_unlock(&hdlc_gb_aggregate_lock);
+}
+
+static int gb_message_hdlc_aggregate(struct gb_message *msg, uint16_t cport)
+{
+	const uint16_t cport_le = sys_cpu_to_le16(cport);
+	const uint16_t marker = sys_cpu_to_le16(HDLC_GREYBUS_CPORT_AGGREGATE);
+	const k_timeout_t timeout = K_MSEC(CONFIG_BEAGLEPLAY_HDLC_TX_TIMEOUT_MS);
+	size_t len = sys_le16_to_cpu(msg->header.size) + sizeof(cport);
+	uint8_t *buf;
+	int ret = 0;
+
+	k_mutex_lock(&hdlc_gb_aggregate_lock, K_FOREVER);
+
+	/* Make room synchronously. The message is refused if the pending frame cannot be sent */
+	if (hdlc_gb_aggregate_len + len > HDLC_MAX_BLOCK_SIZE) {
+		ret = hdlc_gb_aggregate_flush(timeout);
+		if (ret < 0) {
+			LOG_ERR("Failed to send aggregated Greybus frame (%d)", ret);
+			goto unlock;
+		}
+	}
+
+	if (hdlc_gb_aggregate_count == 0) {
+		memcpy(hdlc_gb_aggregate_buf, &marker, sizeof(marker));
+		hdlc_gb_aggregate_len = sizeof(marker);
+		hdlc_gb_aggregate_schedule();
+	}
+
+	buf = &hdlc_gb_aggregate_buf[hdlc_gb_aggregate_len];
+	memcpy(buf, &cport_le, sizeof(cport_le));
+	memcpy(&buf[sizeof(cport_le)], &msg->header, sizeof(struct gb_operation_msg_hdr));
+	memcpy(&buf[sizeof(cport_le) + sizeof(struct gb_operation_msg_hdr)], msg->payload,
+	       gb_message_payload_len(msg));
+	hdlc_gb_aggregate_len += len;
+	hdlc_gb_aggregate_count++;
+
+	/* The message is queued either way. If this flush fails, the timer retries it */
+	if (hdlc_gb_aggregate_len >= CONFIG_BEAGLEPLAY_HDLC_GREYBUS_AGGREGATE_THRESHOLD &&
+	    hdlc_gb_aggregate_flush(timeout) == 0) {
+		k_work_cancel_delayable(&hdlc_gb_aggregate_work);
+	}
+
+unlock:
+	k_mutex_unlock(&hdlc_gb_aggregate_lock);
+
+	return ret;
+}
+#endif
+
+#ifdef CONFIG_BEAGLEPLAY_HDLC_GREYBUS_FRAGMENT
+static int gb_message_hdlc_fragment(const struct hdlc_iovec *iov, size_t iovcnt)
+{
+	uint8_t hdr[HDLC_GB_FRAGMENT_HDR_LEN];
+	/* A fragment spans at most every source buffer, plus its own header */
+	struct hdlc_iovec frag_iov[4];
+	size_t idx = 0, off = 0, room, n, take;
+	size_t remaining = hdlc_iov_len(iov, iovcnt);
+	uint8_t flags = HDLC_GREYBUS_FRAGMENT_FIRST;
+	int ret = 0;
+
+	__ASSERT_NO_MSG(iovcnt < ARRAY_SIZE(frag_iov));
+
+	sys_put_le16(HDLC_GREYBUS_CPORT_FRAGMENT, hdr);
+	frag_iov[0].base = hdr;
+	frag_iov[0].len = sizeof(hdr);
+
+	k_mutex_lock(&hdlc_gb_fragment_lock, K_FOREVER);
+
+	while (remaining) {
+		room = HDLC_MAX_BLOCK_SIZE - sizeof(hdr);
+		n = 1;
+
+		while (room && idx < iovcnt) {
+			take = MIN(room, iov[idx].len - off);
+			if (take) {
+				frag_iov[n].base = (const uint8_t *)iov[idx].base + off;
+				frag_iov[n].len = take;
+				n++;
+			}
+
+			room -= take;
+			off += take;
+			remaining -= take;
+			if (off == iov[idx].len) {
+				idx++;
+				off = 0;
+			}
+		}
+
+		if (remaining == 0) {
+			flags |= HDLC_GREYBUS_FRAGMENT_LAST;
+		}
+		hdr[sizeof(uint16_t)] = flags;
+
+		ret = hdlc_block_send_iov_async(frag_iov, n, ADDRESS_GREYBUS, 0x03);
+		if (ret < 0) {
+			LOG_ERR("Failed to send Greybus fragment (%d)", ret);
+			break;
+		}
+
+		flags = 0;
+	}
+
+	k_mutex_unlock(&hdlc_gb_fragment_lock);
+
+	return ret;
+}
+#endif
+
+int gb_message_hdlc_send(struct gb_message *msg, uint16_t cport)
+{
+	const uint16_t cport_le = sys_cpu_to_le16(cport);
+	const struct hdlc_iovec iov[] = {
+		{&cport_le, sizeof(cport_le)},
+		{&msg->header, sizeof(struct gb_operation_msg_hdr)},
+		{msg->payload, gb_message_payload_len(msg)},
+	};
+	size_t len = sys_le16_to_cpu(msg->header.size) + sizeof(cport);
+#ifdef CONFIG_BEAGLEPLAY_HDLC_GREYBUS_AGGREGATE
+	int ret;
+#endif
+
+#ifndef CONFIG_BEAGLEPLAY_HDLC_GREYBUS_FRAGMENT
+	if (len > HDLC_MAX_BLOCK_SIZE) {
+		return -EMSGSIZE;
+	}
+#endif
+
+#ifdef CONFIG_BEAGLEPLAY_HDLC_GREYBUS_AGGREGATE
+	/* Only messages which leave room for the aggregate header can share a frame */
+	if (len + sizeof(uint16_t) <= HDLC_MAX_BLOCK_SIZE) {
+		return gb_message_hdlc_aggregate(msg, cport);
+	}
+
+	/* Keep ordering with messages still waiting for aggregation */
+	k_mutex_lock(&hdlc_gb_aggregate_lock, K_FOREVER);
+	ret = hdlc_gb_aggregate_flush(K_MSEC(CONFIG_BEAGLEPLAY_HDLC_TX_TIMEOUT_MS));
+	k_mutex_unlock(&hdlc_gb_aggregate_lock);
+	if (ret < 0) {
+		LOG_ERR("Failed to send aggregated Greybus frame (%d)", ret);
+		return ret;
+	}
+#endif
+
+#ifdef CONFIG_BEAGLEPLAY_HDLC_GREYBUS_FRAGMENT
+	if (len > HDLC_MAX_BLOCK_SIZE) {
+		return gb_message_hdlc_fragment(iov, ARRAY_SIZE(iov));
+	}
+#endif
+
+	return hdlc_block_send_iov_async(iov, ARRAY_SIZE(iov), ADDRESS_GREYBUS, 0x03);
+}
+
+void hdlc_link_reset(void)
 {
-	hdlc_driver.crc = 0xffff;
+	k_mutex_lock(&hdlc_tx_lock, K_FOREVER);
+
 	hdlc_driver.send_seq = 0;
 	hdlc_driver.rx_send_seq = 0;
-	hdlc_driver.next_escaped = false;
-	hdlc_driver.rx_buffer_len = 0;
+
+#ifdef CONFIG_BEAGLEPLAY_HDLC_RELIABLE
+	k_work_cancel_delayable(&hdlc_retransmit_work);
+	hdlc_driver.recv_seq = 0;
+	hdlc_driver.win_head = 0;
+	hdlc_driver.rej_sent = false;
+	hdlc_driver.ack_pending = false;
+
+	k_sem_reset(&hdlc_window_sem);
+	for (size_t i = 0; i < HDLC_WINDOW_SIZE; ++i) {
+		k_sem_give(&hdlc_window_sem);
+	}
+#endif
+
+	k_mutex_unlock(&hdlc_tx_lock);
+}
+
+int hdlc_init(hdlc_process_frame_callback process_cb, hdlc_send_frame_callback send_cb,
+	      hdlc_tx_notify_callback tx_cb)
+{
+	const struct k_work_queue_config cfg = {
+		.name = "hdlc_rx",
+	};
+
+	hdlc_deframer_init(&hdlc_driver.rx);
 
 	hdlc_driver.process_callback_frame_cb = process_cb;
 	hdlc_driver.send_frame_cb = send_cb;
+	hdlc_driver.tx_notify_cb = tx_cb;
+
+	hdlc_link_reset();
+
+	k_work_queue_start(&hdlc_rx_workq, hdlc_rx_workq_stack,
+			   K_THREAD_STACK_SIZEOF(hdlc_rx_workq_stack), HDLC_RX_WORKQUEUE_PRIORITY,
+			   &cfg);
 
 	return 0;
 }
 
 uint32_t hdlc_rx_start(uint8_t **buf)
 {
-	return ring_buf_put_claim(&hdlc_rx_ringbuf, buf, HDLC_RX_BUF_SIZE);
+	uint32_t len = ring_buf_put_claim(&hdlc_rx_ringbuf, buf, HDLC_RX_BUF_SIZE);
+
+	if (len == 0) {
+		stats_inc(STATS_HDLC_RX_RING_FULL);
+		atomic_set(&hdlc_rx_paused, 1);
+	}
+
+	return len;
 }
 
 int hdlc_rx_finish(uint32_t written)
 {
 	int ret;
 
+	/* Stamped before the data becomes visible, so it is never older than the data */
+	atomic_set(&hdlc_rx_last_cycles, k_cycle_get_32());
 	ret = ring_buf_put_finish(&hdlc_rx_ringbuf, written);
-	k_work_submit(&hdlc_rx_work);
+	stats_add(STATS_HDLC_RX_BYTES, written);
+	stats_max(STATS_HDLC_RX_RING_MAX, ring_buf_size_get(&hdlc_rx_ringbuf));
+	k_work_submit_to_queue(&hdlc_rx_workq, &hdlc_rx_work);
 
 	return ret;
 }
+
+/* Pick the ring to transmit from. A partially transmitted frame is always finished first */
+static struct hdlc_tx_ring *hdlc_tx_arbitrate(void)
+{
+	size_t i;
+
+	for (i = 0; i < ARRAY_SIZE(hdlc_tx_rings); ++i) {
+		if (hdlc_tx_rings[i].in_frame) {
+			return &hdlc_tx_rings[i];
+		}
+	}
+
+	for (i = 0; i < ARRAY_SIZE(hdlc_tx_rings); ++i) {
+		if (!ring_buf_is_empty(hdlc_tx_rings[i].ringbuf)) {
+			return &hdlc_tx_rings[i];
+		}
+	}
+
+	return NULL;
+}
+
+uint32_t hdlc_rx_cycles(void)
+{
+	return hdlc_driver.rx_cycles;
+}
+
+uint32_t hdlc_tx_start(uint8_t **buf)
+{
+	struct hdlc_tx_ring *ring = hdlc_tx_arbitrate();
+	size_t skip;
+	uint8_t *end;
+	uint32_t len;
+
+	hdlc_tx_current = ring;
+	if (!ring) {
+		return 0;
+	}
+
+	len = ring_buf_get_claim(ring->ringbuf, buf, ring_buf_capacity_get(ring->ringbuf));
+
+	/*
+	 * Stop at the closing flag of the current frame so that the next one is arbitrated again.
+	 * Flags never appear inside a frame, and a new frame starts with its opening flag.
+	 */
+	skip = ring->in_frame ? 0 : 1;
+	end = (len > skip) ? memchr(*buf + skip, HDLC_FRAME, len - skip) : NULL;
+	if (end) {
+		len = end - *buf + 1;
+	}
+
+	ring->claim_closes = (end != NULL);
+	ring->claimed = len;
+
+	return len;
+}
+
+int hdlc_tx_finish(uint32_t sent)
+{
+	struct hdlc_tx_ring *ring = hdlc_tx_current;
+	int ret;
+
+	if (!ring) {
+		return (sent == 0) ? 0 : -EINVAL;
+	}
+
+	ret = ring_buf_get_finish(ring->ringbuf, sent);
+	if (ret == 0 && sent > 0) {
+		ring->in_frame = !(ring->claim_closes && sent == ring->claimed);
+	}
+	k_sem_give(ring->space);
+
+	if (hdlc_tx_idle_cb && hdlc_tx_is_idle()) {
+		hdlc_tx_idle_cb();
+	}
+
+	return ret;
+}
+
+void hdlc_panic(void)
+{
+	hdlc_panic_mode = true;
+}
+
+void hdlc_tx_set_idle_callback(hdlc_tx_notify_callback cb)
+{
+	hdlc_tx_idle_cb = cb;
+}
+
+void hdlc_rx_set_resume_callback(hdlc_rx_resume_callback cb)
+{
+	hdlc_rx_resume_cb = cb;
+}
+
+bool hdlc_tx_is_idle(void)
+{
+	for (size_t i = 0; i < ARRAY_SIZE(hdlc_tx_rings); ++i) {
+		if (!ring_buf_is_empty(hdlc_tx_rings[i].ringbuf)) {
+			return false;
+		}
+	}
+
+	return true;
+}
+
+bool hdlc_tx_congested(void)
+{
+	return ring_buf_size_get(&hdlc_tx_ringbuf) * 100 >
+	       ring_buf_capacity_get(&hdlc_tx_ringbuf) * CONFIG_BEAGLEPLAY_HDLC_TX_CONGESTION_PERCENT;
+}
+
+int hdlc_tx_stats_get(enum hdlc_tx_class class, struct hdlc_tx_stats *stats)
+{
+	struct hdlc_tx_ring *ring;
+
+	if (class >= HDLC_TX_CLASS_COUNT) {
+		return -EINVAL;
+	}
+
+	ring = &hdlc_tx_rings[class];
+
+	k_mutex_lock(ring->lock, K_FOREVER);
+	*stats = ring->stats;
+	k_mutex_unlock(ring->lock);
+
+	return 0;
+}
@@ -0,0 +1,240 @@
+// SPDX-License-Identifier: Apache-2.0
+/*
+ * Copyright (c) 2016-2019 Intel Corporation
+ * Copyright (c) 2020 Statropy Software LLC
+ *
+ * Modifications Copyright (c) 2023 Ayush Singh <ayushdevel1325@gmail.com>
+ */
+
+#include "hdlc_codec.h"
+#include <string.h>
+
+/* CRC-16/CCITT (reflected, polynomial 0x8408) lookup table */
+static const uint16_t hdlc_crc_table[256] = {
+	0x0000, 0x1189, 0x2312, 0x329b, 0x4624, 0x57ad, 0x6536, 0x74bf,
+	0x8c48, 0x9dc1, 0xaf5a, 0xbed3, 0xca6c, 0xdbe5, 0xe97e, 0xf8f7,
+	0x1081, 0x0108, 0x3393, 0x221a, 0x56a5, 0x472c, 0x75b7, 0x643e,
+	0x9cc9, 0x8d40, 0xbfdb, 0xae52, 0xdaed, 0xcb64, 0xf9ff, 0xe876,
+	0x2102, 0x308b, 0x0210, 0x1399, 0x6726, 0x76af, 0x4434, 0x55bd,
+	0xad4a, 0xbcc3, 0x8e58, 0x9fd1, 0xeb6e, 0xfae7, 0xc87c, 0xd9f5,
+	0x3183, 0x200a, 0x1291, 0x0318, 0x77a7, 0x662e, 0x54b5, 0x453c,
+	0xbdcb, 0xac42, 0x9ed9, 0x8f50, 0xfbef, 0xea66, 0xd8fd, 0xc974,
+	0x4204, 0x538d, 0x6116, 0x709f, 0x0420, 0x15a9, 0x2732, 0x36bb,
+	0xce4c, 0xdfc5, 0xed5e, 0xfcd7, 0x8868, 0x99e1, 0xab7a, 0xbaf3,
+	0x5285, 0x430c, 0x7197, 0x601e, 0x14a1, 0x0528, 0x37b3, 0x263a,
+	0xdecd, 0xcf44, 0xfddf, 0xec56, 0x98e9, 0x8960, 0xbbfb, 0xaa72,
+	0x6306, 0x728f, 0x4014, 0x519d, 0x2522, 0x34ab, 0x0630, 0x17b9,
+	0xef4e, 0xfec7, 0xcc5c, 0xddd5, 0xa96a, 0xb8e3, 0x8a78, 0x9bf1,
+	0x7387, 0x620e, 0x5095, 0x411c, 0x35a3, 0x242a, 0x16b1, 0x0738,
+	0xffcf, 0xee46, 0xdcdd, 0xcd54, 0xb9eb, 0xa862, 0x9af9, 0x8b70,
+	0x8408, 0x9581, 0xa71a, 0xb693, 0xc22c, 0xd3a5, 0xe13e, 0xf0b7,
+	0x0840, 0x19c9, 0x2b52, 0x3adb, 0x4e64, 0x5fed, 0x6d76, 0x7cff,
+	0x9489, 0x8500, 0xb79b, 0xa612, 0xd2ad, 0xc324, 0xf1bf, 0xe036,
+	0x18c1, 0x0948, 0x3bd3, 0x2a5a, 0x5ee5, 0x4f6c, 0x7df7, 0x6c7e,
+	0xa50a, 0xb483, 0x8618, 0x9791, 0xe32e, 0xf2a7, 0xc03c, 0xd1b5,
+	0x2942, 0x38cb, 0x0a50, 0x1bd9, 0x6f66, 0x7eef, 0x4c74, 0x5dfd,
+	0xb58b, 0xa402, 0x9699, 0x8710, 0xf3af, 0xe226, 0xd0bd, 0xc134,
+	0x39c3, 0x284a, 0x1ad1, 0x0b58, 0x7fe7, 0x6e6e, 0x5cf5, 0x4d7c,
+	0xc60c, 0xd785, 0xe51e, 0xf497, 0x8028, 0x91a1, 0xa33a, 0xb2b3,
+	0x4a44, 0x5bcd, 0x6956, 0x78df, 0x0c60, 0x1de9, 0x2f72, 0x3efb,
+	0xd68d, 0xc704, 0xf59f, 0xe416, 0x90a9, 0x8120, 0xb3bb, 0xa232,
+	0x5ac5, 0x4b4c, 0x79d7, 0x685e, 0x1ce1, 0x0d68, 0x3ff3, 0x2e7a,
+	0xe70e, 0xf687, 0xc41c, 0xd595, 0xa12a, 0xb0a3, 0x8238, 0x93b1,
+	0x6b46, 0x7acf, 0x4854, 0x59dd, 0x2d62, 0x3ceb, 0x0e70, 0x1ff9,
+	0xf78f, 0xe606, 0xd49d, 0xc514, 0xb1ab, 0xa022, 0x92b9, 0x8330,
+	0x7bc7, 0x6a4e, 0x58d5, 0x495c, 0x3de3, 0x2c6a, 0x1ef1, 0x0f78,
+};
+
+uint16_t hdlc_crc16(uint16_t crc, const uint8_t *buf, size_t len)
+{
+	for (size_t i = 0; i < len; ++i) {
+		crc = (crc >> 8) ^ hdlc_crc_table[(crc ^ buf[i]) & 0xff];
+	}
+
+	return crc;
+}
+
+/* Non-zero if any byte of the word is zero */
+#define HDLC_WORD_HAS_ZERO(w) (((w) - 0x01010101U) & ~(w) & 0x80808080U)
+/* Non-zero if any byte of the word is a flag or escape byte */
+#define HDLC_WORD_HAS_SPECIAL(w)                                                                   \
+	(HDLC_WORD_HAS_ZERO((w) ^ (0x01010101U * HDLC_FRAME)) |                                    \
+	 HDLC_WORD_HAS_ZERO((w) ^ (0x01010101U * HDLC_ESC)))
+
+static inline bool hdlc_is_special(uint8_t byte)
+{
+	return byte == HDLC_FRAME || byte == HDLC_ESC;
+}
+
+/* Aligned data is scanned a word at a time */
+size_t hdlc_clean_run_len(const uint8_t *buf, size_t len)
+{
+	size_t i = 0;
+	uint32_t word;
+
+	for (; i < len && ((uintptr_t)&buf[i] & (sizeof(word) - 1)); ++i) {
+		if (hdlc_is_special(buf[i])) {
+			return i;
+		}
+	}
+
+	for (; i + sizeof(word) <= len; i += sizeof(word)) {
+		memcpy(&word, &buf[i], sizeof(word));
+		if (HDLC_WORD_HAS_SPECIAL(word)) {
+			break;
+		}
+	}
+
+	for (; i < len; ++i) {
+		if (hdlc_is_special(buf[i])) {
+			return i;
+		}
+	}
+
+	return len;
+}
+
+/* Escape and copy a buffer while updating the CRC over the unescaped bytes */
+static size_t hdlc_escape_crc(uint8_t *dst, const uint8_t *src, size_t len, uint16_t *crc)
+{
+	size_t run, pos = 0;
+
+	while (len) {
+		run = hdlc_clean_run_len(src, len);
+		*crc = hdlc_crc16(*crc, src, run);
+		memcpy(&dst[pos], src, run);
+		pos += run;
+		src += run;
+		len -= run;
+
+		if (len) {
+			*crc = hdlc_crc16(*crc, src, 1);
+			dst[pos++] = HDLC_ESC;
+			dst[pos++] = *src++ ^ 0x20;
+			len--;
+		}
+	}
+
+	return pos;
+}
+
+size_t hdlc_iov_len(const struct hdlc_iovec *iov, size_t iovcnt)
+{
+	size_t len = 0;
+
+	for (size_t i = 0; i < iovcnt; ++i) {
+		len += iov[i].len;
+	}
+
+	return len;
+}
+
+size_t hdlc_frame_encode(uint8_t *dst, const struct hdlc_iovec *iov, size_t iovcnt,
+			 uint8_t address, uint8_t control)
+{
+	uint8_t hdr[2] = {address, control};
+	uint8_t crc_le[2];
+	uint16_t crc = 0xffff;
+	size_t pos = 0;
+
+	dst[pos++] = HDLC_FRAME;
+	pos += hdlc_escape_crc(&dst[pos], hdr, sizeof(hdr), &crc);
+	for (size_t i = 0; i < iovcnt; ++i) {
+		pos += hdlc_escape_crc(&dst[pos], iov[i].base, iov[i].len, &crc);
+	}
+	crc ^= 0xffff;
+	crc_le[0] = crc & 0xff;
+	crc_le[1] = crc >> 8;
+	pos += hdlc_escape_crc(&dst[pos], crc_le, sizeof(crc_le), &crc);
+	dst[pos++] = HDLC_FRAME;
+
+	return pos;
+}
+
+void hdlc_deframer_init(struct hdlc_deframer *deframer)
+{
+	deframer->crc = 0xffff;
+	deframer->next_escaped = false;
+	deframer->len = 0;
+}
+
+static void hdlc_save_byte(struct hdlc_deframer *deframer, uint8_t byte)
+{
+	if (deframer->len >= HDLC_MAX_BLOCK_SIZE) {
+		deframer->overflows++;
+		deframer->crc = 0xffff;
+		deframer->len = 0;
+	}
+
+	deframer->buffer[deframer->len++] = byte;
+}
+
+static void hdlc_deframe_byte(struct hdlc_deframer *deframer, uint8_t byte,
+			      hdlc_deframe_callback cb, void *user_data)
+{
+	switch (byte) {
+	case HDLC_FRAME:
+		if (deframer->len) {
+			cb(deframer, user_data);
+			deframer->crc = 0xffff;
+			deframer->len = 0;
+		}
+		break;
+	case HDLC_ESC:
+		deframer->escapes++;
+		deframer->next_escaped = true;
+		break;
+	default:
+		if (deframer->next_escaped) {
+			byte ^= 0x20;
+			deframer->next_escaped = false;
+		}
+		deframer->crc = hdlc_crc16(deframer->crc, &byte, 1);
+		hdlc_save_byte(deframer, byte);
+	}
+}
+
+/*
+ * Save unescaped data bytes up to the next flag or escape byte. Equivalent to hdlc_deframe_byte()
+ * for each of them. CRC, special byte check and copy share a single pass, which unlike a separate
+ * word scan also pays off for the short runs of small frames.
+ *
+ * @return number of bytes consumed. 0 if the next byte needs the byte state machine
+ */
+static size_t hdlc_deframe_run(struct hdlc_deframer *deframer, const uint8_t *buf, size_t len)
+{
+	const size_t space = HDLC_MAX_BLOCK_SIZE - deframer->len;
+	uint8_t *dst = &deframer->buffer[deframer->len];
+	uint16_t crc = deframer->crc;
+	size_t i;
+
+	/* A full buffer is left to the byte path, which handles the overflow */
+	len = (len < space) ? len : space;
+
+	for (i = 0; i < len && !hdlc_is_special(buf[i]); ++i) {
+		crc = (crc >> 8) ^ hdlc_crc_table[(crc ^ buf[i]) & 0xff];
+		dst[i] = buf[i];
+	}
+
+	deframer->crc = crc;
+	deframer->len += i;
+
+	return i;
+}
+
+void hdlc_deframe(struct hdlc_deframer *deframer, const uint8_t *buf, size_t len,
+		  hdlc_deframe_callback cb, void *user_data)
+{
+	size_t i = 0;
+
+	while (i < len) {
+		/* Escaped bytes, flags and escapes go through the byte state machine */
+		if (!deframer->next_escaped) {
+			i += hdlc_deframe_run(deframer, &buf[i], len - i);
+		}
+
+		if (i < len) {
+			hdlc_deframe_byte(deframer, buf[i++], cb, user_data);
+		}
+	}
+}
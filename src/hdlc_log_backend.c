@@ -7,50 +7,226 @@
 #include <zephyr/logging/log_output.h>
 #include <zephyr/logging/log_backend.h>
 #include <zephyr/logging/log_backend_std.h>
+#include <zephyr/sys/ring_buffer.h>
+#ifdef CONFIG_BEAGLEPLAY_HDLC_LOG_DICTIONARY
+#include <zephyr/logging/log_output_dict.h>
+#endif
 
 #define UART_DEVICE_NODE DT_CHOSEN(zephyr_shell_uart)
-#define BUFFER_LEN       200
+#define BUFFER_LEN       MIN(200, HDLC_MAX_BLOCK_SIZE)
+#define LOG_BUF_SIZE     CONFIG_BEAGLEPLAY_HDLC_LOG_BUF_SIZE
+/* Token bucket counts are kept in thousandths of a message */
+#define LOG_TOKEN        1000
+
+/**
+ * struct hdlc_log_bucket - Token bucket rate limiting the messages of a log level
+ *
+ * @tokens: available tokens
+ * @last: uptime of the last refill in milliseconds
+ */
+struct hdlc_log_bucket {
+	uint32_t tokens;
+	uint32_t last;
+};
 
 static const struct device *const uart_dev = DEVICE_DT_GET(UART_DEVICE_NODE);
 static uint8_t hdlc_uart_buffer[BUFFER_LEN];
+static bool panic_mode;
+static uint32_t hdlc_log_format =
+	IS_ENABLED(CONFIG_BEAGLEPLAY_HDLC_LOG_DICTIONARY) ? LOG_OUTPUT_DICT : LOG_OUTPUT_TEXT;
+
+/* Queue of length prefixed log chunks */
+RING_BUF_DECLARE(hdlc_log_ringbuf, LOG_BUF_SIZE);
+static struct k_spinlock hdlc_log_lock;
+/*
+ * All of the firmware logs through a single module, so buckets are kept per level. Noisy debug
+ * output then cannot starve errors.
+ */
+static struct hdlc_log_bucket hdlc_log_buckets[LOG_LEVEL_DBG + 1];
+/* Counted by the log thread and by hdlc_uart_out() in any context */
+static atomic_t hdlc_log_dropped;
+
+static void hdlc_log_flush(struct k_work *work);
+
+static K_WORK_DEFINE(hdlc_log_work, hdlc_log_flush);
+
+/*
+ * Send one queued chunk while the HDLC TX path is idle. Once it has been transmitted, the idle
+ * callback submits this work again for the next one.
+ *
+ * The chunk is only removed from the queue once it has been sent, so a chunk which could not be
+ * sent is retried on the next idle event. This work is the only consumer of the queue outside of
+ * panic mode.
+ */
+static void hdlc_log_flush(struct k_work *work)
+{
+	static uint8_t buf[sizeof(uint16_t) + BUFFER_LEN];
+	k_spinlock_key_t key;
+	uint16_t len;
+	int ret;
+
+	if (panic_mode || !hdlc_tx_is_idle()) {
+		return;
+	}
+
+	key = k_spin_lock(&hdlc_log_lock);
+	if (ring_buf_peek(&hdlc_log_ringbuf, buf, sizeof(buf)) < sizeof(len)) {
+		k_spin_unlock(&hdlc_log_lock, key);
+		return;
+	}
+	k_spin_unlock(&hdlc_log_lock, key);
+
+	memcpy(&len, buf, sizeof(len));
+	ret = hdlc_block_send_async(&buf[sizeof(len)], len, ADDRESS_DBG, 0x03);
+	if (ret < 0) {
+		return;
+	}
+
+	key = k_spin_lock(&hdlc_log_lock);
+	ring_buf_get(&hdlc_log_ringbuf, NULL, sizeof(len) + len);
+	k_spin_unlock(&hdlc_log_lock, key);
+}
+
+static void hdlc_log_tx_idle(void)
+{
+	if (!ring_buf_is_empty(&hdlc_log_ringbuf)) {
+		k_work_submit(&hdlc_log_work);
+	}
+}
 
 static int hdlc_uart_out(uint8_t *data, size_t length, void *ctx)
 {
 	ARG_UNUSED(ctx);
 
-	hdlc_block_send_sync(data, length, ADDRESS_DBG, 0x03);
+	k_spinlock_key_t key;
+	uint16_t len = length;
+
+	/* Interrupts cannot be relied upon to drain the TX ring after a panic */
+	if (panic_mode) {
+		hdlc_block_send_sync(data, length, ADDRESS_DBG, 0x03);
+		return length;
+	}
+
+	key = k_spin_lock(&hdlc_log_lock);
+	if (ring_buf_space_get(&hdlc_log_ringbuf) < sizeof(len) + length) {
+		atomic_inc(&hdlc_log_dropped);
+	} else {
+		ring_buf_put(&hdlc_log_ringbuf, (uint8_t *)&len, sizeof(len));
+		ring_buf_put(&hdlc_log_ringbuf, data, length);
+	}
+	k_spin_unlock(&hdlc_log_lock, key);
+
+	k_work_submit(&hdlc_log_work);
+
 	return length;
 }
 
 LOG_OUTPUT_DEFINE(hdlc_uart_output, hdlc_uart_out, hdlc_uart_buffer, BUFFER_LEN);
 
+/*
+ * Take a token from the bucket of the message level
+ *
+ * @return true if the message may be sent
+ */
+static bool hdlc_log_allowed(uint8_t level)
+{
+	struct hdlc_log_bucket *bucket = &hdlc_log_buckets[MIN(level, LOG_LEVEL_DBG)];
+	uint32_t now = k_uptime_get_32();
+	/* Clamped so that refilling cannot overflow */
+	uint32_t elapsed = MIN(now - bucket->last, CONFIG_BEAGLEPLAY_HDLC_LOG_BURST * LOG_TOKEN);
+
+	bucket->tokens = MIN(bucket->tokens + elapsed * CONFIG_BEAGLEPLAY_HDLC_LOG_RATE,
+			     CONFIG_BEAGLEPLAY_HDLC_LOG_BURST * LOG_TOKEN);
+	bucket->last = now;
+
+	if (bucket->tokens < LOG_TOKEN) {
+		return false;
+	}
+
+	bucket->tokens -= LOG_TOKEN;
+	return true;
+}
+
+static void hdlc_log_dropped_process(uint32_t cnt)
+{
+#ifdef CONFIG_BEAGLEPLAY_HDLC_LOG_DICTIONARY
+	if (hdlc_log_format == LOG_OUTPUT_DICT) {
+		log_dict_output_dropped_process(&hdlc_uart_output, cnt);
+		return;
+	}
+#endif
+
+	log_backend_std_dropped(&hdlc_uart_output, cnt);
+}
+
 static void hdlc_uart_backend_process(const struct log_backend *const backend,
 				      union log_msg_generic *msg)
 {
 	ARG_UNUSED(backend);
 
 	uint32_t flags = log_backend_std_get_flags();
+	log_format_func_t log_output_func = log_format_func_t_get(hdlc_log_format);
+	uint32_t dropped;
 
-	log_output_msg_process(&hdlc_uart_output, &msg->log, flags);
+	if (!panic_mode && !hdlc_log_allowed(log_msg_get_level(&msg->log))) {
+		atomic_inc(&hdlc_log_dropped);
+		return;
+	}
+
+	/* Report messages lost to rate limiting or a full queue */
+	dropped = atomic_clear(&hdlc_log_dropped);
+	if (dropped) {
+		hdlc_log_dropped_process(dropped);
+	}
+
+	log_output_func(&hdlc_uart_output, &msg->log, flags);
 }
 
 static void hdlc_uart_backend_dropped(const struct log_backend *const backend, uint32_t cnt)
 {
 	ARG_UNUSED(backend);
 
-	log_backend_std_dropped(&hdlc_uart_output, cnt);
+	hdlc_log_dropped_process(cnt);
 }
 
 static void hdlc_uart_backend_panic(const struct log_backend *const backend)
 {
 	ARG_UNUSED(backend);
 
+	/* Kept off the stack of the panicking thread, which may be nearly exhausted */
+	static uint8_t buf[BUFFER_LEN];
+	k_spinlock_key_t key;
+	uint16_t len;
+	bool queued;
+
+	panic_mode = true;
+	hdlc_panic();
+
+	/* Send what is still queued before anything logged from now on */
+	for (;;) {
+		key = k_spin_lock(&hdlc_log_lock);
+		queued = ring_buf_get(&hdlc_log_ringbuf, (uint8_t *)&len, sizeof(len)) ==
+			 sizeof(len);
+		if (queued) {
+			ring_buf_get(&hdlc_log_ringbuf, buf, len);
+		}
+		k_spin_unlock(&hdlc_log_lock, key);
+
+		if (!queued) {
+			break;
+		}
+
+		hdlc_block_send_sync(buf, len, ADDRESS_DBG, 0x03);
+	}
+
 	log_backend_std_panic(&hdlc_uart_output);
 }
 
 static void hdlc_uart_backend_init(const struct log_backend *const backend)
 {
 	ARG_UNUSED(backend);
+
+	hdlc_tx_set_idle_callback(hdlc_log_tx_idle);
 }
 
 static int hdlc_uart_backend_is_ready(const struct log_backend *const backend)
@@ -67,7 +243,14 @@ static int hdlc_uart_backend_is_ready(const struct log_backend *const backend)
 static int hdlc_uart_backend_format_set(const struct log_backend *const backend, uint32_t log_type)
 {
 	ARG_UNUSED(backend);
-	ARG_UNUSED(log_type);
+
+	/* Dropped message reports follow the format, see hdlc_log_dropped_process() */
+	if (log_type != LOG_OUTPUT_TEXT &&
+	    !(IS_ENABLED(CONFIG_BEAGLEPLAY_HDLC_LOG_DICTIONARY) && log_type == LOG_OUTPUT_DICT)) {
+		return -EINVAL;
+	}
+
+	hdlc_log_format = log_type;
 
 	return 0;
 }
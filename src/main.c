@@ -6,7 +6,10 @@
 #include "ap.h"
 #include <greybus/greybus_protocols.h>
 #include "hdlc.h"
+#include "msg_pool.h"
 #include "node.h"
+#include "op_trace.h"
+#include "stats.h"
 #include "tcp_discovery.h"
 #include <zephyr/drivers/uart.h>
 #include <zephyr/init.h>
@@ -18,11 +21,35 @@
 #define UART_DEVICE_NODE  DT_CHOSEN(zephyr_shell_uart)
 #define CONTROL_SVC_START 0x01
 #define CONTROL_SVC_STOP  0x02
+/* Followed by a stats_section and an index. Answered with the command and a snapshot */
+#define CONTROL_STATS     0x03
+/* Followed by a little endian sequence number. Answered with the command and trace records */
+#define CONTROL_TRACE     0x04
 
 LOG_MODULE_REGISTER(cc1352_greybus, CONFIG_BEAGLEPLAY_GREYBUS_LOG_LEVEL);
 
 static const struct device *const uart_dev = DEVICE_DT_GET(UART_DEVICE_NODE);
 
+#ifdef CONFIG_BEAGLEPLAY_HDLC_GREYBUS_FRAGMENT
+static void hdlc_greybus_reassembly_timeout(struct k_work *work);
+
+/**
+ * struct hdlc_greybus_reassembly - Greybus frame being reassembled from fragments
+ *
+ * @buffer: reassembly buffer from gb_reassembly_slab, NULL if idle
+ * @len: number of bytes reassembled so far
+ */
+struct hdlc_greybus_reassembly {
+	uint8_t *buffer;
+	size_t len;
+};
+
+K_MEM_SLAB_DEFINE_STATIC(gb_reassembly_slab, CONFIG_BEAGLEPLAY_HDLC_GREYBUS_REASSEMBLY_SIZE, 1, 4);
+static K_MUTEX_DEFINE(gb_reassembly_lock);
+static K_WORK_DELAYABLE_DEFINE(gb_reassembly_work, hdlc_greybus_reassembly_timeout);
+static struct hdlc_greybus_reassembly gb_reassembly;
+#endif
+
 /**
  * struct hdlc_greybus_frame - Structure to represent greybus HDLC frame
  *
@@ -47,40 +74,90 @@ static int hdlc_send_callback(const uint8_t *buffer, size_t buffer_len)
 	return i;
 }
 
-static void serial_callback(const struct device *dev, void *user_data)
+static void hdlc_tx_callback(void)
 {
-	ARG_UNUSED(user_data);
+	uart_irq_tx_enable(uart_dev);
+}
 
+static void hdlc_rx_resume(void)
+{
+	uart_irq_rx_enable(uart_dev);
+}
+
+static void serial_rx_process(const struct device *dev)
+{
 	uint8_t *buf;
+	uint32_t space;
 	int ret;
 
-	if (!uart_irq_update(dev) && !uart_irq_rx_ready(dev)) {
-		return;
-	}
+	/* The free space may be split by the end of the ring. Keep reading while the FIFO fills
+	 * the whole claim */
+	do {
+		space = hdlc_rx_start(&buf);
+		if (space == 0) {
+			/* Leave the data in the UART instead of spinning in the ISR until space is freed.
+			 * Re-enabled by hdlc_rx_resume */
+			uart_irq_rx_disable(dev);
+			return;
+		}
+
+		ret = uart_fifo_read(dev, buf, space);
+		if (ret < 0) {
+			/* Something went wrong */
+			LOG_ERR("Failed to read UART");
+			return;
+		}
+
+		space = (ret == space) ? space : 0;
+
+		ret = hdlc_rx_finish(ret);
+		if (ret < 0) {
+			/* Some error */
+			LOG_ERR("Filed to write data to hdlc buffer");
+			return;
+		}
+	} while (space);
+}
 
-	ret = hdlc_rx_start(&buf);
+static void serial_tx_process(const struct device *dev)
+{
+	uint8_t *buf;
+	int ret;
+
+	ret = hdlc_tx_start(&buf);
 	if (ret == 0) {
-		/* No space */
-		LOG_ERR("No more space for HDLC receive");
+		/* Nothing left to send. Re-enabled by hdlc_tx_notify_callback */
+		uart_irq_tx_disable(dev);
 		return;
 	}
 
-	ret = uart_fifo_read(dev, buf, ret);
+	ret = uart_fifo_fill(dev, buf, ret);
 	if (ret < 0) {
-		/* Something went wrong */
-		LOG_ERR("Failed to read UART");
-		return;
+		LOG_ERR("Failed to write UART");
+		ret = 0;
 	}
 
-	ret = hdlc_rx_finish(ret);
-	if (ret < 0) {
-		/* Some error */
-		LOG_ERR("Filed to write data to hdlc buffer");
+	hdlc_tx_finish(ret);
+}
+
+static void serial_callback(const struct device *dev, void *user_data)
+{
+	ARG_UNUSED(user_data);
+
+	if (!uart_irq_update(dev)) {
 		return;
 	}
+
+	if (uart_irq_rx_ready(dev)) {
+		serial_rx_process(dev);
+	}
+
+	if (uart_irq_tx_ready(dev)) {
+		serial_tx_process(dev);
+	}
 }
 
-static int hdlc_process_greybus_frame(const char *buffer, size_t buffer_len)
+static int hdlc_process_greybus_message(const char *buffer, size_t buffer_len)
 {
 	struct gb_message *msg;
 	int ret;
@@ -93,15 +170,28 @@ static int hdlc_process_greybus_frame(const char *buffer, size_t buffer_len)
 		return -1;
 	}
 
-	msg = gb_message_alloc(gb_hdr_payload_len(hdr), gb_frame->hdr.type,
-			       gb_frame->hdr.operation_id, gb_frame->hdr.result);
+	/* Also guards every record of an aggregated frame */
+	if (sys_le16_to_cpu(gb_frame->hdr.size) < sizeof(struct gb_operation_msg_hdr)) {
+		LOG_ERR("Greybus Message size is smaller than its header.");
+		return -1;
+	}
+
+	/* The SVC in the greybus library releases what it receives with gb_message_dealloc */
+	if (sys_le16_to_cpu(gb_frame->cport) == AP_SVC_CPORT_ID) {
+		msg = msg_pool_alloc_heap(hdr);
+	} else {
+		msg = msg_pool_alloc(hdr);
+	}
 	if (!msg) {
 		LOG_ERR("Failed to allocate greybus message");
 		return -1;
 	}
 
 	memcpy(msg->payload, gb_frame->payload, gb_message_payload_len(msg));
+	op_trace_record_at(OP_TRACE_HDLC_RX, hdlc_rx_cycles(), AP_INF_ID,
+			   sys_le16_to_cpu(gb_frame->cport), hdr);
 	ret = ap_rx_submit(msg, sys_le16_to_cpu(gb_frame->cport));
+	op_trace_record(OP_TRACE_AP_SUBMIT, AP_INF_ID, sys_le16_to_cpu(gb_frame->cport), hdr);
 	if (ret < 0) {
 		LOG_ERR("Failed add message to AP Queue");
 		return ret;
@@ -110,10 +200,186 @@ static int hdlc_process_greybus_frame(const char *buffer, size_t buffer_len)
 	return 0;
 }
 
-static int control_process_frame(const char *buffer, size_t buffer_len)
+static int hdlc_process_greybus_aggregate(const char *buffer, size_t buffer_len)
+{
+	const struct hdlc_greybus_frame *gb_frame;
+	size_t pos = 0, len;
+	int ret;
+
+	while (pos < buffer_len) {
+		if (buffer_len - pos < sizeof(struct hdlc_greybus_frame)) {
+			LOG_ERR("Truncated aggregated Greybus frame");
+			return -1;
+		}
+
+		gb_frame = (const struct hdlc_greybus_frame *)&buffer[pos];
+		len = sizeof(uint16_t) + sys_le16_to_cpu(gb_frame->hdr.size);
+		if (len > buffer_len - pos) {
+			LOG_ERR("Greybus Message size is greater than received buffer.");
+			return -1;
+		}
+
+		ret = hdlc_process_greybus_message(&buffer[pos], len);
+		if (ret < 0) {
+			return ret;
+		}
+
+		pos += len;
+	}
+
+	return 0;
+}
+
+#ifdef CONFIG_BEAGLEPLAY_HDLC_GREYBUS_FRAGMENT
+/* Must be called with gb_reassembly_lock held */
+static void hdlc_greybus_reassembly_drop(void)
+{
+	if (gb_reassembly.buffer) {
+		k_mem_slab_free(&gb_reassembly_slab, gb_reassembly.buffer);
+		gb_reassembly.buffer = NULL;
+	}
+	gb_reassembly.len = 0;
+}
+
+static void hdlc_greybus_reassembly_timeout(struct k_work *work)
+{
+	ARG_UNUSED(work);
+
+	k_mutex_lock(&gb_reassembly_lock, K_FOREVER);
+	if (gb_reassembly.buffer) {
+		LOG_ERR("Greybus reassembly timed out after %zu bytes", gb_reassembly.len);
+		hdlc_greybus_reassembly_drop();
+	}
+	k_mutex_unlock(&gb_reassembly_lock);
+}
+
+static int hdlc_process_greybus_fragment(const char *buffer, size_t buffer_len)
+{
+	uint8_t flags;
+	int ret = 0;
+
+	if (buffer_len < sizeof(flags)) {
+		LOG_ERR("Greybus fragment too short");
+		return -1;
+	}
+
+	flags = buffer[0];
+	buffer += sizeof(flags);
+	buffer_len -= sizeof(flags);
+
+	k_mutex_lock(&gb_reassembly_lock, K_FOREVER);
+
+	if (flags & HDLC_GREYBUS_FRAGMENT_FIRST) {
+		if (gb_reassembly.buffer) {
+			LOG_ERR("Dropping incomplete Greybus reassembly");
+			hdlc_greybus_reassembly_drop();
+		}
+
+		ret = k_mem_slab_alloc(&gb_reassembly_slab, (void **)&gb_reassembly.buffer,
+				       K_NO_WAIT);
+		if (ret < 0) {
+			LOG_ERR("Failed to allocate Greybus reassembly buffer");
+			gb_reassembly.buffer = NULL;
+			goto unlock;
+		}
+
+		k_work_reschedule(&gb_reassembly_work,
+				  K_MSEC(CONFIG_BEAGLEPLAY_HDLC_GREYBUS_REASSEMBLY_TIMEOUT_MS));
+	} else if (!gb_reassembly.buffer) {
+		LOG_ERR("Greybus fragment without start");
+		ret = -1;
+		goto unlock;
+	}
+
+	if (buffer_len > CONFIG_BEAGLEPLAY_HDLC_GREYBUS_REASSEMBLY_SIZE - gb_reassembly.len) {
+		LOG_ERR("Reassembled Greybus frame too large");
+		hdlc_greybus_reassembly_drop();
+		ret = -1;
+		goto unlock;
+	}
+
+	memcpy(&gb_reassembly.buffer[gb_reassembly.len], buffer, buffer_len);
+	gb_reassembly.len += buffer_len;
+
+	if (flags & HDLC_GREYBUS_FRAGMENT_LAST) {
+		k_work_cancel_delayable(&gb_reassembly_work);
+		ret = hdlc_process_greybus_message((const char *)gb_reassembly.buffer,
+						   gb_reassembly.len);
+		hdlc_greybus_reassembly_drop();
+	}
+
+unlock:
+	k_mutex_unlock(&gb_reassembly_lock);
+	return ret;
+}
+#endif
+
+static int hdlc_process_greybus_frame(const char *buffer, size_t buffer_len)
+{
+	uint16_t cport;
+
+	if (buffer_len < sizeof(cport)) {
+		LOG_ERR("Greybus frame too short");
+		return -1;
+	}
+
+	memcpy(&cport, buffer, sizeof(cport));
+	switch (sys_le16_to_cpu(cport)) {
+	case HDLC_GREYBUS_CPORT_AGGREGATE:
+		return hdlc_process_greybus_aggregate(&buffer[sizeof(cport)],
+						      buffer_len - sizeof(cport));
+#ifdef CONFIG_BEAGLEPLAY_HDLC_GREYBUS_FRAGMENT
+	case HDLC_GREYBUS_CPORT_FRAGMENT:
+		return hdlc_process_greybus_fragment(&buffer[sizeof(cport)],
+						     buffer_len - sizeof(cport));
+#endif
+	}
+
+	return hdlc_process_greybus_message(buffer, buffer_len);
+}
+
+static int control_send_stats(uint8_t section, uint8_t index)
+{
+	uint8_t response[HDLC_MAX_BLOCK_SIZE];
+	int ret;
+
+	response[0] = CONTROL_STATS;
+	ret = stats_snapshot(section, index, &response[1], sizeof(response) - 1);
+	if (ret < 0) {
+		LOG_ERR("Invalid stats section %u", section);
+		return ret;
+	}
+
+	return hdlc_block_send_async(response, ret + 1, ADDRESS_CONTROL, 0x03);
+}
+
+static int control_send_trace(uint32_t seq)
+{
+	uint8_t response[HDLC_MAX_BLOCK_SIZE];
+	int ret;
+
+	response[0] = CONTROL_TRACE;
+	ret = op_trace_dump(seq, &response[1], sizeof(response) - 1);
+	if (ret < 0) {
+		LOG_ERR("Failed to dump trace (%d)", ret);
+		return ret;
+	}
+
+	return hdlc_block_send_async(response, ret + 1, ADDRESS_CONTROL, 0x03);
+}
+
+static int control_process_frame(const uint8_t *buffer, size_t buffer_len)
 {
 	uint8_t command;
 
+	if (buffer_len == 3 && buffer[0] == CONTROL_STATS) {
+		return control_send_stats(buffer[1], buffer[2]);
+	}
+
+	if (buffer_len == 5 && buffer[0] == CONTROL_TRACE) {
+		return control_send_trace(sys_get_le32(&buffer[1]));
+	}
+
 	if (buffer_len != 1) {
 		LOG_ERR("Invalid Buffer");
 		return -1;
@@ -124,6 +390,7 @@ static int control_process_frame(const char *buffer, size_t buffer_len)
 	switch (command) {
 	case CONTROL_SVC_START: {
 		LOG_INF("Starting SVC");
+		hdlc_link_reset();
 		ap_init();
 		gb_apbridge_init();
 		gb_svc_init();
@@ -171,7 +438,8 @@ int main(void)
 		return -ENODEV;
 	}
 
-	hdlc_init(hdlc_process_complete_frame, hdlc_send_callback);
+	hdlc_init(hdlc_process_complete_frame, hdlc_send_callback, hdlc_tx_callback);
+	hdlc_rx_set_resume_callback(hdlc_rx_resume);
 
 	ret = uart_irq_callback_user_data_set(uart_dev, serial_callback, NULL);
 	if (ret < 0) {
@@ -0,0 +1,233 @@
+// SPDX-License-Identifier: Apache-2.0
+/*
+ * Copyright (c) 2023 Ayush Singh <ayushdevel1325@gmail.com>
+ */
+
+#include "msg_pool.h"
+#include "stats.h"
+#include <string.h>
+#include <zephyr/init.h>
+#include <zephyr/kernel.h>
+#include <zephyr/logging/log.h>
+#include <zephyr/sys/atomic.h>
+#include <zephyr/sys/byteorder.h>
+#include <zephyr/sys/util.h>
+
+#define MSG_POOL_BLOCK_SIZE(payload) ROUND_UP(sizeof(struct gb_message) + (payload), sizeof(void *))
+
+#define MSG_POOL_SMALL_BLOCK  MSG_POOL_BLOCK_SIZE(CONFIG_BEAGLEPLAY_MSG_POOL_SMALL_SIZE)
+#define MSG_POOL_MEDIUM_BLOCK MSG_POOL_BLOCK_SIZE(CONFIG_BEAGLEPLAY_MSG_POOL_MEDIUM_SIZE)
+#define MSG_POOL_LARGE_BLOCK  MSG_POOL_BLOCK_SIZE(CONFIG_BEAGLEPLAY_MSG_POOL_LARGE_SIZE)
+
+#ifdef CONFIG_BEAGLEPLAY_HDLC_GREYBUS_FRAGMENT
+/* Payload of the largest message a reassembled frame, cport and header included, can carry */
+#define MSG_POOL_REASSEMBLY_SIZE                                                                   \
+	(CONFIG_BEAGLEPLAY_HDLC_GREYBUS_REASSEMBLY_SIZE - sizeof(uint16_t) -                        \
+	 sizeof(struct gb_operation_msg_hdr))
+#define MSG_POOL_REASSEMBLY_BLOCK MSG_POOL_BLOCK_SIZE(MSG_POOL_REASSEMBLY_SIZE)
+#define MSG_POOL_MAX_SIZE         MSG_POOL_REASSEMBLY_SIZE
+
+BUILD_ASSERT(MSG_POOL_REASSEMBLY_SIZE > CONFIG_BEAGLEPLAY_MSG_POOL_LARGE_SIZE,
+	     "Reassembled messages must be larger than the large size class");
+#else
+#define MSG_POOL_MAX_SIZE CONFIG_BEAGLEPLAY_MSG_POOL_LARGE_SIZE
+#endif
+
+BUILD_ASSERT(CONFIG_BEAGLEPLAY_MSG_POOL_SMALL_SIZE < CONFIG_BEAGLEPLAY_MSG_POOL_MEDIUM_SIZE &&
+		     CONFIG_BEAGLEPLAY_MSG_POOL_MEDIUM_SIZE < CONFIG_BEAGLEPLAY_MSG_POOL_LARGE_SIZE,
+	     "Message pool size classes must be increasing");
+
+LOG_MODULE_DECLARE(cc1352_greybus, CONFIG_BEAGLEPLAY_GREYBUS_LOG_LEVEL);
+
+/**
+ * struct msg_pool_class - Slab of equally sized greybus messages
+ *
+ * @slab: slab allocator
+ * @buffer: memory backing the slab
+ * @payload_size: largest payload which fits in a block
+ * @block_size: size of a block
+ * @num_blocks: number of blocks
+ * @used: blocks currently allocated
+ * @max_used: high-water mark of used
+ * @failures: failed allocations
+ */
+struct msg_pool_class {
+	struct k_mem_slab slab;
+	char *buffer;
+	size_t payload_size;
+	size_t block_size;
+	size_t num_blocks;
+	atomic_t used;
+	atomic_t max_used;
+	atomic_t failures;
+};
+
+static char __aligned(sizeof(void *))
+	small_buffer[MSG_POOL_SMALL_BLOCK * CONFIG_BEAGLEPLAY_MSG_POOL_SMALL_COUNT];
+static char __aligned(sizeof(void *))
+	medium_buffer[MSG_POOL_MEDIUM_BLOCK * CONFIG_BEAGLEPLAY_MSG_POOL_MEDIUM_COUNT];
+static char __aligned(sizeof(void *))
+	large_buffer[MSG_POOL_LARGE_BLOCK * CONFIG_BEAGLEPLAY_MSG_POOL_LARGE_COUNT];
+#ifdef CONFIG_BEAGLEPLAY_HDLC_GREYBUS_FRAGMENT
+static char __aligned(sizeof(void *))
+	reassembly_buffer[MSG_POOL_REASSEMBLY_BLOCK * CONFIG_BEAGLEPLAY_MSG_POOL_REASSEMBLY_COUNT];
+#endif
+
+static struct msg_pool_class msg_pool[MSG_POOL_CLASSES] = {
+	{
+		.buffer = small_buffer,
+		.payload_size = CONFIG_BEAGLEPLAY_MSG_POOL_SMALL_SIZE,
+		.block_size = MSG_POOL_SMALL_BLOCK,
+		.num_blocks = CONFIG_BEAGLEPLAY_MSG_POOL_SMALL_COUNT,
+	},
+	{
+		.buffer = medium_buffer,
+		.payload_size = CONFIG_BEAGLEPLAY_MSG_POOL_MEDIUM_SIZE,
+		.block_size = MSG_POOL_MEDIUM_BLOCK,
+		.num_blocks = CONFIG_BEAGLEPLAY_MSG_POOL_MEDIUM_COUNT,
+	},
+	{
+		.buffer = large_buffer,
+		.payload_size = CONFIG_BEAGLEPLAY_MSG_POOL_LARGE_SIZE,
+		.block_size = MSG_POOL_LARGE_BLOCK,
+		.num_blocks = CONFIG_BEAGLEPLAY_MSG_POOL_LARGE_COUNT,
+	},
+#ifdef CONFIG_BEAGLEPLAY_HDLC_GREYBUS_FRAGMENT
+	{
+		.buffer = reassembly_buffer,
+		.payload_size = MSG_POOL_REASSEMBLY_SIZE,
+		.block_size = MSG_POOL_REASSEMBLY_BLOCK,
+		.num_blocks = CONFIG_BEAGLEPLAY_MSG_POOL_REASSEMBLY_COUNT,
+	},
+#endif
+};
+
+static void msg_pool_update_max(struct msg_pool_class *cls, atomic_val_t used)
+{
+	atomic_val_t max = atomic_get(&cls->max_used);
+
+	while (used > max && !atomic_cas(&cls->max_used, max, used)) {
+		max = atomic_get(&cls->max_used);
+	}
+}
+
+static struct msg_pool_class *msg_pool_find(const void *ptr)
+{
+	const char *p = ptr;
+	size_t i;
+
+	for (i = 0; i < ARRAY_SIZE(msg_pool); ++i) {
+		if (p >= msg_pool[i].buffer &&
+		    p < msg_pool[i].buffer + msg_pool[i].block_size * msg_pool[i].num_blocks) {
+			return &msg_pool[i];
+		}
+	}
+
+	return NULL;
+}
+
+/* The one constructor of pooled and heap messages. The header is kept as received */
+static struct gb_message *msg_pool_init_msg(void *block, const struct gb_operation_msg_hdr *hdr)
+{
+	struct gb_message *msg = block;
+
+	memset(msg, 0, sizeof(struct gb_message));
+	memcpy(&msg->header, hdr, sizeof(struct gb_operation_msg_hdr));
+
+	return msg;
+}
+
+struct gb_message *msg_pool_alloc_heap(const struct gb_operation_msg_hdr *hdr)
+{
+	void *block = k_malloc(sizeof(struct gb_message) + gb_hdr_payload_len(hdr));
+
+	if (!block) {
+		stats_inc(STATS_GB_ALLOC_FAILURES);
+		return NULL;
+	}
+
+	return msg_pool_init_msg(block, hdr);
+}
+
+struct gb_message *msg_pool_alloc(const struct gb_operation_msg_hdr *hdr)
+{
+	size_t payload_len = gb_hdr_payload_len(hdr);
+	struct msg_pool_class *cls = NULL;
+	void *block;
+	size_t i;
+
+	if (payload_len > MSG_POOL_MAX_SIZE) {
+		return msg_pool_alloc_heap(hdr);
+	}
+
+	/* Start at the smallest fitting class and spill over into larger ones */
+	for (i = 0; i < ARRAY_SIZE(msg_pool); ++i) {
+		if (payload_len > msg_pool[i].payload_size) {
+			continue;
+		}
+
+		if (!cls) {
+			cls = &msg_pool[i];
+		}
+
+		if (k_mem_slab_alloc(&msg_pool[i].slab, &block, K_NO_WAIT) == 0) {
+			msg_pool_update_max(&msg_pool[i], atomic_inc(&msg_pool[i].used) + 1);
+			return msg_pool_init_msg(block, hdr);
+		}
+	}
+
+	atomic_inc(&cls->failures);
+	stats_inc(STATS_GB_ALLOC_FAILURES);
+
+	return NULL;
+}
+
+void msg_pool_free(struct gb_message *msg)
+{
+	struct msg_pool_class *cls = msg_pool_find(msg);
+
+	if (!cls) {
+		gb_message_dealloc(msg);
+		return;
+	}
+
+	k_mem_slab_free(&cls->slab, msg);
+	atomic_dec(&cls->used);
+}
+
+int msg_pool_stats_get(size_t size_class, struct msg_pool_stats *stats)
+{
+	struct msg_pool_class *cls;
+
+	if (size_class >= ARRAY_SIZE(msg_pool)) {
+		return -EINVAL;
+	}
+
+	cls = &msg_pool[size_class];
+	stats->payload_size = cls->payload_size;
+	stats->num_blocks = cls->num_blocks;
+	stats->used = atomic_get(&cls->used);
+	stats->max_used = atomic_get(&cls->max_used);
+	stats->failures = atomic_get(&cls->failures);
+
+	return 0;
+}
+
+static int msg_pool_init(void)
+{
+	size_t i;
+	int ret;
+
+	for (i = 0; i < ARRAY_SIZE(msg_pool); ++i) {
+		ret = k_mem_slab_init(&msg_pool[i].slab, msg_pool[i].buffer, msg_pool[i].block_size,
+				      msg_pool[i].num_blocks);
+		if (ret < 0) {
+			LOG_ERR("Failed to initialize message pool %zu (%d)", i, ret);
+			return ret;
+		}
+	}
+
+	return 0;
+}
+
+SYS_INIT(msg_pool_init, POST_KERNEL, CONFIG_APPLICATION_INIT_PRIORITY);
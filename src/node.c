@@ -4,7 +4,13 @@
  */
 
 #include "node.h"
+#include "flow_control.h"
+#include "hdlc.h"
+#include "msg_pool.h"
+#include "op_trace.h"
+#include "stats.h"
 #include <greybus/greybus_messages.h>
+#include <zephyr/init.h>
 #include <zephyr/net/net_ip.h>
 #include <zephyr/sys/dlist.h>
 #include <assert.h>
@@ -16,70 +22,253 @@
 #define MAX_GREYBUS_NODES         CONFIG_GREYBUS_APBRIDGE_CPORTS
 #define NODE_RX_THREAD_STACK_SIZE 2048
 #define NODE_RX_THREAD_PRIORITY   6
+#define NODE_WORKERS              CONFIG_BEAGLEPLAY_NODE_WORKERS
+/* zsock_poll() takes at most CONFIG_ZVFS_POLL_MAX entries, one is the wakeup socketpair */
+#define NODE_WORKER_CAPACITY      (CONFIG_ZVFS_POLL_MAX - 1)
+#define NODE_ADDR_HASH_BITS       5
+#define NODE_ADDR_HASH_SIZE       BIT(NODE_ADDR_HASH_BITS)
+/* Poll interval while reading from nodes is paused by a congested HDLC link */
+#define NODE_RX_THROTTLE_POLL_MS  10
+/* Retry interval of frames which could not get a message from the pool */
+#define NODE_RX_STALL_RETRY_MS    10
+/* Retry interval of new nodes whose initial credits did not fit in the HDLC TX ring */
+#define NODE_INSERT_RETRY_MS      100
 
 LOG_MODULE_DECLARE(cc1352_greybus, CONFIG_BEAGLEPLAY_GREYBUS_LOG_LEVEL);
 
-struct gb_message_in_transport {
-	uint16_t cport_id;
+#define NODE_FRAME_HDR_LEN (sizeof(uint16_t) + sizeof(struct gb_operation_msg_hdr))
+
+BUILD_ASSERT(CONFIG_BEAGLEPLAY_NODE_RX_BUF_SIZE >= NODE_FRAME_HDR_LEN,
+	     "Node receive buffer must hold a frame header");
+BUILD_ASSERT(NODE_WORKER_CAPACITY > 0, "Node workers cannot poll any node socket");
+BUILD_ASSERT(CONFIG_BEAGLEPLAY_NODE_TX_QUEUE_DEPTH <= UINT8_MAX,
+	     "The initial credits of a node must fit in one credit record");
+
+/**
+ * struct node_rx - Receive state of a node socket
+ *
+ * @buffer: bytes received but not parsed yet
+ * @len: valid bytes in buffer
+ * @msg: message whose payload is still being received
+ * @cport_id: cport of msg
+ * @received: payload bytes of msg received so far
+ * @stalled: the message pool was exhausted. Reading stops until the frame at the start of buffer
+ * gets a message
+ */
+struct node_rx {
+	uint8_t buffer[CONFIG_BEAGLEPLAY_NODE_RX_BUF_SIZE];
+	size_t len;
 	struct gb_message *msg;
+	uint16_t cport_id;
+	size_t received;
+	bool stalled;
+};
+
+/**
+ * struct node_tx - Transmit queue of a node socket
+ *
+ * @msgs: queued messages
+ * @cports: cport of each queued message
+ * @queued_at: cycle count when each message was queued
+ * @head: index of the oldest queued message
+ * @count: number of queued messages
+ * @offset: bytes of the oldest message already sent
+ * @stats: queue statistics
+ */
+struct node_tx {
+	struct gb_message *msgs[CONFIG_BEAGLEPLAY_NODE_TX_QUEUE_DEPTH];
+	uint16_t cports[CONFIG_BEAGLEPLAY_NODE_TX_QUEUE_DEPTH];
+	uint32_t queued_at[CONFIG_BEAGLEPLAY_NODE_TX_QUEUE_DEPTH];
+	size_t head;
+	size_t count;
+	size_t offset;
+	struct node_tx_stats stats;
+};
+
+/**
+ * struct node_counters - Lock-free counters behind struct node_stats
+ */
+struct node_counters {
+	atomic_t rx_msgs;
+	atomic_t rx_bytes;
+	atomic_t tx_msgs;
+	atomic_t tx_bytes;
+	atomic_t errors;
+	atomic_t reconnects;
+};
+
+enum node_link {
+	/* Never connected */
+	NODE_LINK_IDLE,
+	NODE_LINK_UP,
+	/* Connection lost, waiting to retry */
+	NODE_LINK_BACKOFF,
+	NODE_LINK_CONNECTING,
 };
 
 struct node_item {
+	bool in_use;
 	int sock;
+	/* Bumped whenever sock changes, survives reuse of the slot */
+	uint16_t sock_gen;
 	uint8_t id;
 	struct in6_addr addr;
+	uint16_t addr_next;
 	struct gb_interface *inf;
+	/* Consecutive discovery rounds the node was missing from */
 	uint8_t fail_count;
+	uint8_t generation;
+	bool pinned;
+	/* Missing from discovery. The worker removes the node and announces its removal */
+	bool expired;
+	/* The worker removes the node without announcing it, see node_destroy_interface */
+	bool destroy;
+	uint8_t worker;
+	enum node_link link;
+	/* The link was up before, so connecting again is a reconnect */
+	bool was_up;
+	uint32_t backoff_ms;
+	int64_t lost_at;
+	int64_t retry_at;
+	struct node_rx rx;
+	struct node_tx tx;
+	struct node_counters counters;
 };
 
-/* Node Cache */
+/**
+ * struct node_worker - Thread servicing the sockets of a subset of nodes
+ *
+ * @thread: worker thread
+ * @pipe_writer: write end of the wakeup socketpair, -1 until created
+ * @nodes: number of nodes assigned to the worker
+ * @pollfds: poll set kept across iterations. Entry 0 is the wakeup socketpair
+ * @pollfd_slots: node cache slot of each poll entry
+ * @pollfd_gens: socket generation of the node each poll entry was synced with
+ * @pollfds_len: number of poll entries
+ * @poll_idx: poll entry of each node slot, 0 if not polled
+ * @dirty: node slots whose poll entry needs to be synced
+ * @recovering: number of nodes of the worker trying to reconnect
+ * @throttled: reading from nodes is paused because the HDLC link to the AP is congested
+ * @rx_stalled: some node of the worker may have its receive path stalled on the message pool
+ *
+ * Other threads only mark node slots dirty, the worker then syncs their poll entries.
+ */
+struct node_worker {
+	struct k_thread thread;
+	int pipe_writer;
+	atomic_t nodes;
+	struct zsock_pollfd pollfds[MAX_GREYBUS_NODES + 1];
+	uint16_t pollfd_slots[MAX_GREYBUS_NODES + 1];
+	uint16_t pollfd_gens[MAX_GREYBUS_NODES + 1];
+	size_t pollfds_len;
+	uint16_t poll_idx[MAX_GREYBUS_NODES];
+	ATOMIC_DEFINE(dirty, MAX_GREYBUS_NODES);
+	atomic_t recovering;
+	bool throttled;
+	bool rx_stalled;
+};
+
+/* Node Cache. Nodes keep their slot for their whole lifetime */
 static struct node_item node_cache[MAX_GREYBUS_NODES];
-static size_t node_cache_pos;
+static size_t node_cache_len;
+
+/* Current discovery round */
+static uint8_t node_generation;
 
-static void node_rx_thread_entry(void *p1, void *p2, void *p3);
+/* Lookup tables into the node cache. Entries hold the slot + 1, 0 meaning no node */
+static uint16_t node_by_id[UINT8_MAX + 1];
+static uint16_t node_by_addr[NODE_ADDR_HASH_SIZE];
 
-K_THREAD_DEFINE(node_rx_thread, NODE_RX_THREAD_STACK_SIZE, node_rx_thread_entry, NULL, NULL, NULL,
-		NODE_RX_THREAD_PRIORITY, 0, 0);
+static struct node_worker node_workers[NODE_WORKERS];
+static K_THREAD_STACK_ARRAY_DEFINE(node_worker_stacks, NODE_WORKERS, NODE_RX_THREAD_STACK_SIZE);
 
-static int local_pipe_writer;
+/* Protects the transmit queues of all nodes */
+static K_MUTEX_DEFINE(node_tx_lock);
+static K_CONDVAR_DEFINE(node_tx_space);
+/* Signalled with node_tx_lock held whenever a node worker removed a node */
+static K_CONDVAR_DEFINE(node_removed);
 
-static void tcpip_module_remove(struct gb_interface *inf)
+static void node_remove(struct node_item *node);
+static void node_insert_handler(struct k_work *work);
+
+/* New nodes to announce to the AP, by interface id */
+static ATOMIC_DEFINE(node_insert_pending, UINT8_MAX + 1);
+static K_WORK_DELAYABLE_DEFINE(node_insert_work, node_insert_handler);
+
+/* Must be called from the worker of the node */
+static void tcpip_module_remove(struct node_item *node)
 {
-	gb_svc_send_module_removed(inf->id);
-	node_destroy_interface(inf);
+	gb_svc_send_module_removed(node->id);
+	node_remove(node);
 }
 
-static void pipe_send()
+static void pipe_send(struct node_worker *worker)
 {
 	const uint8_t temp = 0;
-	int ret = zsock_send(local_pipe_writer, &temp, sizeof(temp), 0);
+	int ret;
+
+	/* The worker syncs all dirty slots once it starts */
+	if (worker->pipe_writer < 0) {
+		return;
+	}
+
+	ret = zsock_send(worker->pipe_writer, &temp, sizeof(temp), 0);
 	if (ret < 0) {
 		LOG_ERR("Failed to write to pipe %d", errno);
 	}
 }
 
-static int node_cache_find_by_addr(const struct in6_addr *addr)
+/*
+ * Let the worker of a node slot update its poll entry
+ */
+static void node_poll_mark(size_t pos)
 {
-	size_t i;
-	int ret;
+	struct node_worker *worker = &node_workers[node_cache[pos].worker];
+
+	atomic_set_bit(worker->dirty, pos);
+	pipe_send(worker);
+}
 
-	for (i = 0; i < node_cache_pos; ++i) {
-		ret = net_ipv6_addr_cmp(&node_cache[i].addr, addr);
-		if (ret) {
-			return i;
+/*
+ * Pick the least loaded worker which can still poll another node. Must be called with
+ * node_tx_lock held.
+ *
+ * @return worker index. -ENOMEM if every worker polls as many sockets as it can
+ */
+static int node_worker_assign(void)
+{
+	uint8_t i, best = 0;
+
+	for (i = 1; i < ARRAY_SIZE(node_workers); ++i) {
+		if (atomic_get(&node_workers[i].nodes) < atomic_get(&node_workers[best].nodes)) {
+			best = i;
 		}
 	}
 
-	return -1;
+	if (atomic_get(&node_workers[best].nodes) >= NODE_WORKER_CAPACITY) {
+		return -ENOMEM;
+	}
+
+	atomic_inc(&node_workers[best].nodes);
+
+	return best;
 }
 
-static int node_cache_find_by_sock(int sock)
+static size_t node_addr_hash(const struct in6_addr *addr)
 {
-	size_t i;
+	uint32_t hash = addr->s6_addr32[0] ^ addr->s6_addr32[1] ^ addr->s6_addr32[2] ^
+			addr->s6_addr32[3];
+
+	return (hash * 0x9e3779b1U) >> (32 - NODE_ADDR_HASH_BITS);
+}
+
+static int node_cache_find_by_addr(const struct in6_addr *addr)
+{
+	uint16_t slot = node_by_addr[node_addr_hash(addr)];
 
-	for (i = 0; i < node_cache_pos; ++i) {
-		if (node_cache[i].sock == sock) {
-			return i;
+	for (; slot; slot = node_cache[slot - 1].addr_next) {
+		if (net_ipv6_addr_cmp(&node_cache[slot - 1].addr, addr)) {
+			return slot - 1;
 		}
 	}
 
@@ -88,144 +277,800 @@ static int node_cache_find_by_sock(int sock)
 
 static int node_cache_find_by_id(uint8_t id)
 {
-	size_t i;
+	return node_by_id[id] - 1;
+}
 
-	for (i = 0; i < node_cache_pos; ++i) {
-		if (node_cache[i].id == id) {
-			return i;
-		}
+/* Must be called with node_tx_lock held */
+static void node_cache_set_sock(size_t pos, int sock)
+{
+	if (node_cache[pos].sock >= 0 || sock >= 0) {
+		node_poll_mark(pos);
 	}
 
-	return -1;
+	node_cache[pos].sock = sock;
+	node_cache[pos].sock_gen++;
+	node_cache[pos].inf->ctrl_data = INT_TO_POINTER(sock);
 }
 
 static int node_cache_add(int sock, uint8_t id, const struct in6_addr *addr,
-			  struct gb_interface *intf)
+			  struct gb_interface *intf, bool pinned)
 {
-	if (node_cache_pos >= MAX_GREYBUS_NODES) {
-		return -ENOMEM;
+	struct node_item *node;
+	size_t pos, hash;
+	uint16_t sock_gen;
+	int ret = 0, worker;
+
+	/* Discovery and the node workers look the cache up concurrently */
+	k_mutex_lock(&node_tx_lock, K_FOREVER);
+
+	if (node_cache_find_by_addr(addr) >= 0) {
+		ret = -EEXIST;
+		goto unlock;
 	}
 
-	node_cache[node_cache_pos].sock = sock;
-	node_cache[node_cache_pos].id = id;
-	net_ipaddr_copy(&node_cache[node_cache_pos].addr, addr);
-	node_cache[node_cache_pos].inf = intf;
-	node_cache[node_cache_pos].fail_count = 0;
+	if (node_cache_len >= MAX_GREYBUS_NODES) {
+		ret = -ENOMEM;
+		goto unlock;
+	}
 
-	node_cache_pos++;
+	worker = node_worker_assign();
+	if (worker < 0) {
+		ret = worker;
+		goto unlock;
+	}
 
-	return 0;
+	for (pos = 0; node_cache[pos].in_use; ++pos) {
+	}
+
+	node = &node_cache[pos];
+	sock_gen = node->sock_gen;
+	memset(node, 0, sizeof(struct node_item));
+	node->in_use = true;
+	node->sock = -1;
+	node->sock_gen = sock_gen;
+	node->id = id;
+	node->generation = node_generation;
+	node->pinned = pinned;
+	node->worker = worker;
+	net_ipaddr_copy(&node->addr, addr);
+	node->inf = intf;
+	node_cache_set_sock(pos, sock);
+
+	node_by_id[id] = pos + 1;
+	hash = node_addr_hash(addr);
+	node->addr_next = node_by_addr[hash];
+	node_by_addr[hash] = pos + 1;
+
+	node_cache_len++;
+
+unlock:
+	k_mutex_unlock(&node_tx_lock);
+
+	return ret;
 }
 
+/* Must be called with node_tx_lock held, by the worker of the node which owns its socket */
 static void node_cache_remove_at(size_t pos)
 {
-	--node_cache_pos;
-	if (pos != node_cache_pos) {
-		memcpy(&node_cache[pos], &node_cache[node_cache_pos], sizeof(struct node_item));
+	struct node_item *node = &node_cache[pos];
+	struct node_tx *tx = &node->tx;
+	uint16_t *link;
+
+	for (; tx->count; tx->count--) {
+		msg_pool_free(tx->msgs[tx->head]);
+		tx->head = (tx->head + 1) % CONFIG_BEAGLEPLAY_NODE_TX_QUEUE_DEPTH;
+	}
+
+	node_cache_set_sock(pos, -1);
+	node_by_id[node->id] = 0;
+	flow_control_forget(node->id);
+	for (link = &node_by_addr[node_addr_hash(&node->addr)]; *link;
+	     link = &node_cache[*link - 1].addr_next) {
+		if (*link == pos + 1) {
+			*link = node->addr_next;
+			break;
+		}
+	}
+
+	if (node->link == NODE_LINK_BACKOFF || node->link == NODE_LINK_CONNECTING) {
+		atomic_dec(&node_workers[node->worker].recovering);
 	}
+
+	node->in_use = false;
+	node_cache_len--;
+	atomic_dec(&node_workers[node->worker].nodes);
+
+	k_condvar_broadcast(&node_tx_space);
 }
 
-static int node_cache_remove_by_id(uint8_t id)
+static void node_rx_dispatch(struct node_item *node, uint16_t cport_id, struct gb_message *msg)
 {
-	int ret = node_cache_find_by_id(id);
-	if (ret >= 0) {
-		node_cache_remove_at(ret);
+	uint32_t start = k_cycle_get_32();
+	size_t len = NODE_FRAME_HDR_LEN + gb_message_payload_len(msg);
+	int ret;
+
+	op_trace_record(OP_TRACE_NODE_RX, node->id, cport_id, &msg->header);
+	atomic_inc(&node->counters.rx_msgs);
+	atomic_add(&node->counters.rx_bytes, len);
+
+	ret = gb_apbridge_send(node->id, cport_id, msg);
+	stats_latency_record(STATS_LATENCY_NODE_RX, start);
+	if (ret < 0) {
+		stats_inc(STATS_AP_SEND_FAILURES);
+		atomic_inc(&node->counters.errors);
+		LOG_ERR("Failed to send message to AP");
+	}
+}
+
+/*
+ * Dispatch all complete frames in the receive buffer. A frame whose payload has not fully arrived
+ * yet gets its message allocated, and the rest of the payload is received straight into it.
+ *
+ * @return 0 if successful. -ENOMEM if the message pool is exhausted, the frame which did not get a
+ * message is then kept at the start of the buffer. Other negative values for a corrupt stream
+ */
+static int node_rx_parse(struct node_item *node)
+{
+	struct node_rx *rx = &node->rx;
+	struct gb_operation_msg_hdr hdr;
+	struct gb_message *msg;
+	size_t pos = 0, payload_len, avail;
+	uint16_t cport_id;
+	int ret = 0;
+
+	while (rx->len - pos >= NODE_FRAME_HDR_LEN) {
+		memcpy(&cport_id, &rx->buffer[pos], sizeof(cport_id));
+		memcpy(&hdr, &rx->buffer[pos + sizeof(cport_id)], sizeof(hdr));
+		cport_id = sys_le16_to_cpu(cport_id);
+
+		if (sys_le16_to_cpu(hdr.size) < sizeof(hdr)) {
+			LOG_ERR("Invalid greybus message size %u", sys_le16_to_cpu(hdr.size));
+			ret = -EINVAL;
+			break;
+		}
+
+		payload_len = gb_hdr_payload_len(&hdr);
+		msg = msg_pool_alloc(&hdr);
+		if (!msg) {
+			ret = -ENOMEM;
+			break;
+		}
+
+		pos += NODE_FRAME_HDR_LEN;
+		avail = MIN(payload_len, rx->len - pos);
+		memcpy(msg->payload, &rx->buffer[pos], avail);
+		pos += avail;
+
+		if (avail < payload_len) {
+			rx->msg = msg;
+			rx->cport_id = cport_id;
+			rx->received = avail;
+			break;
+		}
+
+		node_rx_dispatch(node, cport_id, msg);
 	}
 
+	memmove(rx->buffer, &rx->buffer[pos], rx->len - pos);
+	rx->len -= pos;
+
 	return ret;
 }
 
-static int write_data(int sock, const void *data, size_t len)
+/*
+ * Receive whatever is available on the node socket without blocking.
+ *
+ * @return 0 if successful, -ECONNRESET if the socket was closed by peer. Other negative values in
+ * case of error
+ */
+static int node_rx_process(struct node_item *node)
 {
-	int ret, transmitted = 0;
+	struct node_rx *rx = &node->rx;
+	struct gb_message *msg;
+	ssize_t ret;
 
-	while (transmitted < len) {
-		ret = zsock_send(sock, transmitted + (char *)data, len - transmitted, 0);
-		if (ret < 0) {
-			LOG_ERR("Failed to transmit data");
-			return ret;
+	if (rx->msg) {
+		ret = zsock_recv(node->sock, rx->msg->payload + rx->received,
+				 gb_message_payload_len(rx->msg) - rx->received, ZSOCK_MSG_DONTWAIT);
+	} else {
+		ret = zsock_recv(node->sock, &rx->buffer[rx->len], sizeof(rx->buffer) - rx->len,
+				 ZSOCK_MSG_DONTWAIT);
+	}
+
+	if (ret == 0) {
+		return -ECONNRESET;
+	}
+
+	if (ret < 0) {
+		return (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -errno;
+	}
+
+	if (!rx->msg) {
+		rx->len += ret;
+		ret = node_rx_parse(node);
+		if (ret == -ENOMEM) {
+			/* Not a link failure. TCP holds the node back until the pool recovers */
+			LOG_WRN("Message pool exhausted, pausing node %u", node->id);
+			atomic_inc(&node->counters.errors);
+			rx->stalled = true;
+			return 0;
 		}
-		transmitted += ret;
+
+		return ret;
+	}
+
+	rx->received += ret;
+	if (rx->received == gb_message_payload_len(rx->msg)) {
+		msg = rx->msg;
+		rx->msg = NULL;
+		node_rx_dispatch(node, rx->cport_id, msg);
 	}
-	return transmitted;
+
+	return 0;
 }
 
-static int read_data(int sock, void *data, size_t len)
+static size_t node_tx_frame_len(const struct gb_message *msg)
 {
-	int ret, received = 0;
+	return sizeof(uint16_t) + sizeof(struct gb_operation_msg_hdr) + gb_message_payload_len(msg);
+}
 
-	while (received < len) {
-		ret = zsock_recv(sock, received + (char *)data, len - received, 0);
-		if (ret <= 0) {
-			LOG_ERR("Failed to receive data");
-			return ret;
+/*
+ * Send as much of the node transmit queue as the socket accepts without blocking. Up to
+ * CONFIG_BEAGLEPLAY_NODE_TX_BATCH messages are gathered into one send.
+ *
+ * @return 0 if successful. Negative in case of error
+ */
+static int node_tx_process(struct node_item *node)
+{
+	struct iovec iov[CONFIG_BEAGLEPLAY_NODE_TX_BATCH * 3];
+	uint16_t cport_le[CONFIG_BEAGLEPLAY_NODE_TX_BATCH];
+	struct node_tx *tx = &node->tx;
+	struct msghdr mh = {.msg_iov = iov};
+	const struct gb_message *msg;
+	size_t i, n, idx, skip, frame_len;
+	ssize_t ret;
+
+	k_mutex_lock(&node_tx_lock, K_FOREVER);
+
+	n = MIN(tx->count, CONFIG_BEAGLEPLAY_NODE_TX_BATCH);
+	if (n == 0) {
+		ret = 0;
+		goto unlock;
+	}
+
+	for (i = 0; i < n; ++i) {
+		idx = (tx->head + i) % CONFIG_BEAGLEPLAY_NODE_TX_QUEUE_DEPTH;
+		msg = tx->msgs[idx];
+		cport_le[i] = sys_cpu_to_le16(tx->cports[idx]);
+
+		iov[mh.msg_iovlen].iov_base = &cport_le[i];
+		iov[mh.msg_iovlen++].iov_len = sizeof(uint16_t);
+		iov[mh.msg_iovlen].iov_base = (void *)&msg->header;
+		iov[mh.msg_iovlen++].iov_len = sizeof(struct gb_operation_msg_hdr);
+		iov[mh.msg_iovlen].iov_base = (void *)msg->payload;
+		iov[mh.msg_iovlen++].iov_len = gb_message_payload_len(msg);
+	}
+
+	/* Skip over the part of the oldest message sent previously */
+	for (skip = tx->offset; skip >= mh.msg_iov->iov_len; mh.msg_iovlen--) {
+		skip -= mh.msg_iov->iov_len;
+		mh.msg_iov++;
+	}
+	mh.msg_iov->iov_base = (char *)mh.msg_iov->iov_base + skip;
+	mh.msg_iov->iov_len -= skip;
+
+	ret = zsock_sendmsg(node->sock, &mh, ZSOCK_MSG_DONTWAIT);
+	if (ret < 0) {
+		ret = (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -errno;
+		goto unlock;
+	}
+
+	/* Release fully sent messages */
+	atomic_add(&node->counters.tx_bytes, ret);
+	tx->offset += ret;
+	for (i = 0; i < n; ++i) {
+		frame_len = node_tx_frame_len(tx->msgs[tx->head]);
+		if (tx->offset < frame_len) {
+			break;
 		}
-		received += ret;
+
+		tx->offset -= frame_len;
+		stats_latency_record(STATS_LATENCY_NODE_TX_QUEUE, tx->queued_at[tx->head]);
+		op_trace_record(OP_TRACE_NODE_SEND, node->id, tx->cports[tx->head],
+				&tx->msgs[tx->head]->header);
+		atomic_inc(&node->counters.tx_msgs);
+		msg_pool_free(tx->msgs[tx->head]);
+		tx->head = (tx->head + 1) % CONFIG_BEAGLEPLAY_NODE_TX_QUEUE_DEPTH;
+		tx->count--;
+		tx->stats.sent++;
+	}
+
+	if (i) {
+		flow_control_grant(node->id, i);
+		k_condvar_broadcast(&node_tx_space);
 	}
-	return received;
+	ret = 0;
+
+unlock:
+	k_mutex_unlock(&node_tx_lock);
+	return ret;
 }
 
-static struct gb_message_in_transport gb_message_receive(int sock, bool *flag)
+/*
+ * Queue a message to a node. Ownership of the message is transferred to the queue.
+ */
+static int node_tx_queue(uint8_t id, struct gb_message *msg, uint16_t cport_id)
 {
+	struct node_tx *tx;
+	bool wakeup;
+	size_t pos, idx;
 	int ret;
-	struct gb_operation_msg_hdr hdr;
-	struct gb_message_in_transport msg;
+#ifdef CONFIG_BEAGLEPLAY_NODE_TX_QUEUE_FULL_BLOCK
+	k_timepoint_t end = sys_timepoint_calc(K_MSEC(CONFIG_BEAGLEPLAY_NODE_TX_BLOCK_TIMEOUT_MS));
+#endif
+
+	k_mutex_lock(&node_tx_lock, K_FOREVER);
+
+	while (true) {
+		/* The node cache can change while waiting */
+		ret = node_cache_find_by_id(id);
+		if (ret < 0) {
+			LOG_ERR("Failed to find node %u", id);
+			goto fail;
+		}
+
+		tx = &node_cache[ret].tx;
+		if (tx->count < CONFIG_BEAGLEPLAY_NODE_TX_QUEUE_DEPTH) {
+			break;
+		}
+
+#ifdef CONFIG_BEAGLEPLAY_NODE_TX_QUEUE_FULL_BLOCK
+		if (k_condvar_wait(&node_tx_space, &node_tx_lock, sys_timepoint_timeout(end)) == 0) {
+			continue;
+		}
+#endif
+		LOG_WRN("Node %u transmit queue full", id);
+		tx->stats.dropped++;
+		ret = -ENOBUFS;
+		goto fail;
+	}
+
+	pos = ret;
+	idx = (tx->head + tx->count) % CONFIG_BEAGLEPLAY_NODE_TX_QUEUE_DEPTH;
+	tx->msgs[idx] = msg;
+	tx->cports[idx] = cport_id;
+	tx->queued_at[idx] = k_cycle_get_32();
+	op_trace_record(OP_TRACE_NODE_QUEUE, id, cport_id, &msg->header);
+	wakeup = tx->count++ == 0;
+	tx->stats.max_depth = MAX(tx->stats.max_depth, tx->count);
 
-	ret = read_data(sock, &msg.cport_id, sizeof(uint16_t));
-	if (ret != sizeof(uint16_t)) {
-		*flag = ret == 0;
-		goto early_exit;
+	k_mutex_unlock(&node_tx_lock);
+
+	/* Let the node worker start polling for POLLOUT */
+	if (wakeup) {
+		node_poll_mark(pos);
 	}
-	msg.cport_id = sys_le16_to_cpu(msg.cport_id);
 
-	ret = read_data(sock, &hdr, sizeof(hdr));
-	if (ret != sizeof(hdr)) {
-		*flag = ret == 0;
-		goto early_exit;
+	return 0;
+
+fail:
+	/* The AP spent a credit on the message. A removed node has no credits left to return */
+	if (node_cache_find_by_id(id) >= 0) {
+		flow_control_grant(id, 1);
 	}
+	k_mutex_unlock(&node_tx_lock);
+	msg_pool_free(msg);
+	return ret;
+}
+
+int node_tx_stats_get(uint8_t id, struct node_tx_stats *stats)
+{
+	int ret;
 
-	msg.msg =
-		gb_message_alloc(gb_hdr_payload_len(&hdr), hdr.type, hdr.operation_id, hdr.result);
-	if (!msg.msg) {
-		LOG_ERR("Failed to allocate node message");
-		goto early_exit;
+	k_mutex_lock(&node_tx_lock, K_FOREVER);
+
+	ret = node_cache_find_by_id(id);
+	if (ret >= 0) {
+		*stats = node_cache[ret].tx.stats;
+		stats->depth = node_cache[ret].tx.count;
+		ret = 0;
 	}
 
-	ret = read_data(sock, msg.msg->payload, gb_message_payload_len(msg.msg));
-	if (ret != gb_message_payload_len(msg.msg)) {
-		*flag = ret == 0;
-		goto free_msg;
+	k_mutex_unlock(&node_tx_lock);
+
+	return ret;
+}
+
+int node_stats_get(uint8_t id, struct node_stats *stats)
+{
+	struct node_counters *counters;
+	int ret;
+
+	k_mutex_lock(&node_tx_lock, K_FOREVER);
+
+	ret = node_cache_find_by_id(id);
+	if (ret >= 0) {
+		counters = &node_cache[ret].counters;
+		stats->rx_msgs = atomic_get(&counters->rx_msgs);
+		stats->rx_bytes = atomic_get(&counters->rx_bytes);
+		stats->tx_msgs = atomic_get(&counters->tx_msgs);
+		stats->tx_bytes = atomic_get(&counters->tx_bytes);
+		stats->errors = atomic_get(&counters->errors);
+		stats->reconnects = atomic_get(&counters->reconnects);
+		ret = 0;
 	}
 
-	return msg;
+	k_mutex_unlock(&node_tx_lock);
 
-free_msg:
-	gb_message_dealloc(msg.msg);
-early_exit:
-	msg.cport_id = 0;
-	msg.msg = NULL;
-	return msg;
+	return ret;
 }
 
-static void svc_send_module_removed_by_sock(int sock)
+/*
+ * Bring the poll entry of a node slot in line with the node. Caller must hold node_tx_lock.
+ */
+static void node_poll_sync(struct node_worker *worker, size_t pos)
 {
-	int ret = node_cache_find_by_sock(sock);
-	if (ret < 0) {
-		LOG_ERR("Failed to find node");
+	struct node_item *node = &node_cache[pos];
+	size_t idx = worker->poll_idx[pos], last;
+
+	/* The slot might have been reused by a node of another worker */
+	if (!node->in_use || node->sock < 0 || &node_workers[node->worker] != worker) {
+		if (!idx) {
+			return;
+		}
+
+		/* Move the last entry into the hole */
+		last = --worker->pollfds_len;
+		worker->pollfds[idx] = worker->pollfds[last];
+		worker->pollfd_slots[idx] = worker->pollfd_slots[last];
+		worker->pollfd_gens[idx] = worker->pollfd_gens[last];
+		worker->poll_idx[worker->pollfd_slots[idx]] = idx;
+		worker->poll_idx[pos] = 0;
+		return;
+	}
+
+	if (!idx) {
+		idx = worker->pollfds_len++;
+		worker->pollfd_slots[idx] = pos;
+		worker->poll_idx[pos] = idx;
+	}
+
+	worker->pollfds[idx].fd = node->sock;
+	worker->pollfd_gens[idx] = node->sock_gen;
+	if (node->link == NODE_LINK_CONNECTING) {
+		worker->pollfds[idx].events = ZSOCK_POLLOUT;
 		return;
 	}
 
-	tcpip_module_remove(node_cache[ret].inf);
+	/* Stop reading while throttled or stalled so that TCP pushes back on the node */
+	worker->pollfds[idx].events = (worker->throttled || node->rx.stalled) ? 0 : ZSOCK_POLLIN;
+	if (node->tx.count) {
+		worker->pollfds[idx].events |= ZSOCK_POLLOUT;
+	}
+}
+
+static void node_poll_sync_dirty(struct node_worker *worker)
+{
+	atomic_val_t bits, expired, destroy;
+	struct node_item *node;
+	size_t i, pos;
+
+	for (i = 0; i < ARRAY_SIZE(worker->dirty); ++i) {
+		expired = 0;
+		destroy = 0;
+
+		k_mutex_lock(&node_tx_lock, K_FOREVER);
+		for (bits = atomic_clear(&worker->dirty[i]); bits; bits &= bits - 1) {
+			pos = i * ATOMIC_BITS + find_lsb_set(bits) - 1;
+			node = &node_cache[pos];
+
+			if (node->in_use && &node_workers[node->worker] == worker) {
+				if (node->destroy) {
+					destroy |= bits & -bits;
+					continue;
+				}
+
+				if (node->expired) {
+					expired |= bits & -bits;
+					continue;
+				}
+			}
+
+			node_poll_sync(worker, pos);
+		}
+		k_mutex_unlock(&node_tx_lock);
+
+		/*
+		 * Nodes are only removed here, by their worker, so no I/O on them is in flight. A node
+		 * seen again after this point is removed anyway and added back by the next round.
+		 */
+		for (; destroy; destroy &= destroy - 1) {
+			pos = i * ATOMIC_BITS + find_lsb_set(destroy) - 1;
+			node_remove(&node_cache[pos]);
+		}
+
+		for (; expired; expired &= expired - 1) {
+			pos = i * ATOMIC_BITS + find_lsb_set(expired) - 1;
+			LOG_INF("Removing node %u missing from discovery", node_cache[pos].id);
+			tcpip_module_remove(&node_cache[pos]);
+		}
+	}
+}
+
+static void node_socket_keepalive(int sock)
+{
+	const int enable = 1;
+	const int idle = CONFIG_BEAGLEPLAY_NODE_KEEPALIVE_IDLE_S;
+	const int intvl = CONFIG_BEAGLEPLAY_NODE_KEEPALIVE_INTVL_S;
+	const int cnt = CONFIG_BEAGLEPLAY_NODE_KEEPALIVE_CNT;
+
+	if (zsock_setsockopt(sock, SOL_SOCKET, SO_KEEPALIVE, &enable, sizeof(enable)) < 0 ||
+	    zsock_setsockopt(sock, IPPROTO_TCP, TCP_KEEPIDLE, &idle, sizeof(idle)) < 0 ||
+	    zsock_setsockopt(sock, IPPROTO_TCP, TCP_KEEPINTVL, &intvl, sizeof(intvl)) < 0 ||
+	    zsock_setsockopt(sock, IPPROTO_TCP, TCP_KEEPCNT, &cnt, sizeof(cnt)) < 0) {
+		LOG_WRN("Failed to enable keepalive %d", errno);
+	}
+}
+
+static void node_sockaddr(const struct node_item *node, struct sockaddr_in6 *addr)
+{
+	memset(addr, 0, sizeof(struct sockaddr_in6));
+	memcpy(&addr->sin6_addr, &node->addr, sizeof(struct in6_addr));
+	addr->sin6_family = AF_INET6;
+	addr->sin6_port = htons(GB_TRANSPORT_TCPIP_BASE_PORT);
+}
+
+static void node_rx_reset(struct node_rx *rx)
+{
+	if (rx->msg) {
+		msg_pool_free(rx->msg);
+		rx->msg = NULL;
+	}
+
+	rx->len = 0;
+	rx->stalled = false;
+}
+
+/*
+ * Remove a node from the cache and free everything it holds. Must be called from the worker of the
+ * node, the only thread using its socket and receive state.
+ */
+static void node_remove(struct node_item *node)
+{
+	struct gb_interface *inf = node->inf;
+
+	node_rx_reset(&node->rx);
+	if (node->sock >= 0) {
+		zsock_close(node->sock);
+	}
+
+	k_mutex_lock(&node_tx_lock, K_FOREVER);
+	node_cache_remove_at(node - node_cache);
+	gb_interface_dealloc(inf);
+	k_condvar_broadcast(&node_removed);
+	k_mutex_unlock(&node_tx_lock);
 }
 
-static void node_rx_thread_entry(void *p1, void *p2, void *p3)
+/*
+ * Close the connection of a node and schedule a reconnect with exponential backoff. The interface
+ * stays alive, messages to the node are queued meanwhile.
+ */
+static void node_link_lost(struct node_worker *worker, struct node_item *node)
 {
-	struct zsock_pollfd fds[AP_MAX_NODES + 1];
-	size_t i, fds_len = 1;
-	int pipe[2], ret;
-	uint8_t temp;
-	bool flag = false;
-	struct gb_message_in_transport msg;
+	int64_t now = k_uptime_get();
+
+	atomic_inc(&node->counters.errors);
+
+	if (CONFIG_BEAGLEPLAY_NODE_RECONNECT_GRACE_MS == 0) {
+		tcpip_module_remove(node);
+		return;
+	}
+
+	if (node->sock >= 0) {
+		zsock_close(node->sock);
+	}
+
+	k_mutex_lock(&node_tx_lock, K_FOREVER);
+	node_cache_set_sock(node - node_cache, -1);
+	/* The new connection is a new stream, resend a partially sent message in full */
+	node->tx.offset = 0;
+	k_mutex_unlock(&node_tx_lock);
+
+	node_rx_reset(&node->rx);
+
+	if (node->link == NODE_LINK_UP) {
+		LOG_WRN("Lost connection to node %u", node->id);
+		node->lost_at = now;
+		node->backoff_ms = CONFIG_BEAGLEPLAY_NODE_RECONNECT_BACKOFF_MIN_MS;
+		atomic_inc(&worker->recovering);
+	} else {
+		node->backoff_ms = MIN(node->backoff_ms * 2,
+				       CONFIG_BEAGLEPLAY_NODE_RECONNECT_BACKOFF_MAX_MS);
+	}
+
+	node->link = NODE_LINK_BACKOFF;
+	node->retry_at = now + node->backoff_ms;
+}
+
+static void node_link_connected(struct node_worker *worker, struct node_item *node)
+{
+	socklen_t len = sizeof(int);
+	int err = 0;
+
+	if (zsock_getsockopt(node->sock, SOL_SOCKET, SO_ERROR, &err, &len) < 0 || err) {
+		LOG_DBG("Failed to connect to node %u (%d)", node->id, err);
+		node_link_lost(worker, node);
+		return;
+	}
+
+	if (node->was_up) {
+		LOG_INF("Reconnected to node %u", node->id);
+		atomic_inc(&node->counters.reconnects);
+	} else {
+		LOG_INF("Connected to node %u", node->id);
+	}
+	node->link = NODE_LINK_UP;
+	node->was_up = true;
+	atomic_dec(&worker->recovering);
+
+	k_mutex_lock(&node_tx_lock, K_FOREVER);
+	node_poll_sync(worker, node - node_cache);
+	k_mutex_unlock(&node_tx_lock);
+}
+
+/*
+ * Start a non-blocking connect to the node. Completion is reported by POLLOUT.
+ */
+static void node_link_reconnect(struct node_worker *worker, struct node_item *node)
+{
+	struct sockaddr_in6 addr;
+	int ret, sock;
+
+	sock = zsock_socket(AF_INET6, SOCK_STREAM, IPPROTO_TCP);
+	if (sock < 0) {
+		LOG_ERR("Failed to create socket %d", errno);
+		node_link_lost(worker, node);
+		return;
+	}
+
+	node_socket_keepalive(sock);
+	zsock_fcntl(sock, ZVFS_F_SETFL, ZVFS_O_NONBLOCK);
+
+	node_sockaddr(node, &addr);
+	ret = zsock_connect(sock, (struct sockaddr *)&addr, sizeof(addr));
+	if (ret < 0 && errno != EINPROGRESS) {
+		zsock_close(sock);
+		node_link_lost(worker, node);
+		return;
+	}
+
+	node->link = NODE_LINK_CONNECTING;
+	k_mutex_lock(&node_tx_lock, K_FOREVER);
+	node_cache_set_sock(node - node_cache, sock);
+	k_mutex_unlock(&node_tx_lock);
+
+	if (ret == 0) {
+		node_link_connected(worker, node);
+	}
+}
+
+/*
+ * Retry connections which are due and remove nodes which stayed unreachable for the whole grace
+ * period.
+ *
+ * @return milliseconds until the next deadline. -1 if there is none
+ */
+static int node_worker_recover(struct node_worker *worker)
+{
+	int64_t now, deadline, next = INT64_MAX;
+	struct node_item *node;
+	size_t i;
+
+	if (atomic_get(&worker->recovering) == 0) {
+		return -1;
+	}
+
+	now = k_uptime_get();
+	for (i = 0; i < ARRAY_SIZE(node_cache); ++i) {
+		node = &node_cache[i];
+		if (!node->in_use || &node_workers[node->worker] != worker ||
+		    (node->link != NODE_LINK_BACKOFF && node->link != NODE_LINK_CONNECTING)) {
+			continue;
+		}
+
+		deadline = node->lost_at + CONFIG_BEAGLEPLAY_NODE_RECONNECT_GRACE_MS;
+		if (now >= deadline) {
+			LOG_WRN("Node %u %s", node->id,
+				node->was_up ? "did not come back" : "could not be reached");
+			tcpip_module_remove(node);
+			continue;
+		}
+
+		if (node->link == NODE_LINK_BACKOFF && now >= node->retry_at) {
+			node_link_reconnect(worker, node);
+		}
+
+		if (node->link == NODE_LINK_BACKOFF) {
+			deadline = MIN(deadline, node->retry_at);
+		}
+		next = MIN(next, deadline);
+	}
+
+	return next == INT64_MAX ? -1 : next - now;
+}
+
+/*
+ * Pause or resume reading from the nodes of a worker depending on how full the Greybus HDLC
+ * transmit ring is. Messages from nodes then wait in the TCP windows of the nodes instead of
+ * piling up in the bridge.
+ */
+static void node_worker_throttle(struct node_worker *worker)
+{
+	bool throttled = hdlc_tx_congested();
+	size_t i;
+
+	if (throttled == worker->throttled) {
+		return;
+	}
+
+	LOG_DBG("%s reading from nodes", throttled ? "Pausing" : "Resuming");
+	worker->throttled = throttled;
+	for (i = 1; i < worker->pollfds_len; ++i) {
+		atomic_set_bit(worker->dirty, worker->pollfd_slots[i]);
+	}
+}
+
+/*
+ * Parse the receive buffers of nodes stalled on the message pool again, and resume reading from
+ * those which got their message.
+ *
+ * @return milliseconds until the next retry. -1 if no node is stalled
+ */
+static int node_worker_rx_retry(struct node_worker *worker)
+{
+	struct node_item *node;
+	size_t i;
+	int ret;
+
+	if (!worker->rx_stalled) {
+		return -1;
+	}
+
+	worker->rx_stalled = false;
+	for (i = 0; i < ARRAY_SIZE(node_cache); ++i) {
+		node = &node_cache[i];
+		if (!node->in_use || !node->rx.stalled || &node_workers[node->worker] != worker) {
+			continue;
+		}
+
+		ret = node_rx_parse(node);
+		if (ret == -ENOMEM) {
+			worker->rx_stalled = true;
+			continue;
+		}
+
+		node->rx.stalled = false;
+		if (ret < 0) {
+			LOG_ERR("Failed to receive from node %d", ret);
+			node_link_lost(worker, node);
+			continue;
+		}
+
+		atomic_set_bit(worker->dirty, i);
+	}
+
+	return worker->rx_stalled ? NODE_RX_STALL_RETRY_MS : -1;
+}
+
+static void node_worker_entry(void *p1, void *p2, void *p3)
+{
+	struct node_worker *worker = p1;
+	struct zsock_pollfd *fds = worker->pollfds;
+	struct node_item *node;
+	uint8_t temp[8];
+	int pipe[2], ret, ready, timeout, retry;
+	bool stale;
+	size_t i;
 
 	ret = zsock_socketpair(AF_UNIX, SOCK_STREAM, 0, pipe);
 	if (ret < 0) {
@@ -233,21 +1078,27 @@ static void node_rx_thread_entry(void *p1, void *p2, void *p3)
 		return;
 	}
 
-	local_pipe_writer = pipe[1];
 	fds[0].fd = pipe[0];
+	fds[0].events = ZSOCK_POLLIN;
+	worker->pipe_writer = pipe[1];
 
 	while (1) {
-		/* Populate fds */
-		fds[0].events = ZSOCK_POLLIN;
-		for (i = 0; i < node_cache_pos; ++i) {
-			fds[i + 1].fd = node_cache[i].sock;
-			fds[i + 1].events = ZSOCK_POLLIN;
+		timeout = node_worker_recover(worker);
+		retry = node_worker_rx_retry(worker);
+		if (retry >= 0 && (timeout < 0 || timeout > retry)) {
+			timeout = retry;
 		}
-		fds_len = node_cache_pos + 1;
+		node_worker_throttle(worker);
+		node_poll_sync_dirty(worker);
 
-		LOG_DBG("Polling for %zu sockets", fds_len - 1);
-		ret = zsock_poll(fds, fds_len, -1);
-		if (ret < 0) {
+		if (worker->throttled && (timeout < 0 || timeout > NODE_RX_THROTTLE_POLL_MS)) {
+			/* Nothing signals the end of the congestion, check again soon */
+			timeout = NODE_RX_THROTTLE_POLL_MS;
+		}
+
+		LOG_DBG("Polling for %zu sockets", worker->pollfds_len - 1);
+		ready = zsock_poll(fds, worker->pollfds_len, timeout);
+		if (ready < 0) {
 			LOG_ERR("Failed to poll");
 			continue;
 		}
@@ -255,149 +1106,145 @@ static void node_rx_thread_entry(void *p1, void *p2, void *p3)
 		if (fds[0].revents & ZSOCK_POLLIN) {
 			/* Drain the pipe */
 			LOG_DBG("Wakeup by pipe");
-			zsock_recv(fds[0].fd, &temp, sizeof(temp), 0);
+			zsock_recv(fds[0].fd, temp, sizeof(temp), ZSOCK_MSG_DONTWAIT);
+			ready--;
 		}
 
-		for (i = 1; i < fds_len; ++i) {
-			if (fds[i].revents & ZSOCK_POLLIN) {
-				ret = node_cache_find_by_sock(fds[i].fd);
-				if (ret < 0) {
-					LOG_ERR("Failed to find node");
-					continue;
+		/* Entries only move in node_poll_sync_dirty, so the set is stable here */
+		for (i = 1; i < worker->pollfds_len && ready > 0; ++i) {
+			if (!fds[i].revents) {
+				continue;
+			}
+			ready--;
+
+			node = &node_cache[worker->pollfd_slots[i]];
+
+			/*
+			 * The node might have been removed, or its socket replaced, while polling.
+			 * Socket numbers are reused, so compare the socket generation instead.
+			 */
+			k_mutex_lock(&node_tx_lock, K_FOREVER);
+			stale = !node->in_use || node->sock_gen != worker->pollfd_gens[i] ||
+				&node_workers[node->worker] != worker;
+			k_mutex_unlock(&node_tx_lock);
+			if (stale) {
+				continue;
+			}
+
+			if (node->link == NODE_LINK_CONNECTING) {
+				if (fds[i].revents & ZSOCK_POLLOUT) {
+					node_link_connected(worker, node);
+				} else {
+					node_link_lost(worker, node);
 				}
+				continue;
+			}
 
-				msg = gb_message_receive(fds[i].fd, &flag);
-				if (flag) {
-					LOG_ERR("Socket closed by peer");
-					tcpip_module_remove(node_cache[ret].inf);
+			if (fds[i].revents & ZSOCK_POLLOUT) {
+				if (node_tx_process(node) < 0) {
+					LOG_ERR("Failed to send to node");
+					node_link_lost(worker, node);
 					continue;
 				}
 
-				if (!msg.msg) {
-					LOG_ERR("Failed to get full message");
-					tcpip_module_remove(node_cache[ret].inf);
-					continue;
+				k_mutex_lock(&node_tx_lock, K_FOREVER);
+				node_poll_sync(worker, worker->pollfd_slots[i]);
+				k_mutex_unlock(&node_tx_lock);
+			}
+
+			if (fds[i].revents & ZSOCK_POLLIN) {
+				ret = node_rx_process(node);
+				if (node->rx.stalled) {
+					worker->rx_stalled = true;
+					atomic_set_bit(worker->dirty, worker->pollfd_slots[i]);
 				}
 
-				ret = gb_apbridge_send(node_cache[ret].id, msg.cport_id, msg.msg);
-				if (ret < 0) {
-					LOG_ERR("Failed to send message to AP");
-					continue;
+				if (ret == -ECONNRESET) {
+					LOG_ERR("Socket closed by peer");
+					node_link_lost(worker, node);
+				} else if (ret < 0) {
+					LOG_ERR("Failed to receive from node %d", ret);
+					node_link_lost(worker, node);
 				}
 			} else if (fds[i].revents & ZSOCK_POLLNVAL) {
 				LOG_WRN("Socket invalid");
-				svc_send_module_removed_by_sock(fds[i].fd);
+				node_link_lost(worker, node);
 			} else if (fds[i].revents & ZSOCK_POLLHUP) {
 				LOG_WRN("Socket pollhup");
-				svc_send_module_removed_by_sock(fds[i].fd);
+				node_link_lost(worker, node);
 			} else if (fds[i].revents & ZSOCK_POLLERR) {
 				LOG_WRN("Socket error");
-				svc_send_module_removed_by_sock(fds[i].fd);
+				node_link_lost(worker, node);
 			}
 		}
 	}
 }
 
-static int gb_message_send(int sock, const struct gb_message *msg, uint16_t cport)
+static int node_workers_init(void)
 {
-	int ret;
-	uint16_t cport_le = sys_cpu_to_le16(cport);
-
-	ret = write_data(sock, &cport_le, sizeof(uint16_t));
-	if (ret != sizeof(uint16_t)) {
-		LOG_ERR("Failed to send CPort ID to node");
-		goto early_exit;
-	}
+	struct node_worker *worker;
+	size_t i;
 
-	ret = write_data(sock, &msg->header, sizeof(struct gb_operation_msg_hdr));
-	if (ret != sizeof(struct gb_operation_msg_hdr)) {
-		LOG_ERR("Failed to send Greybus Message Header to node");
-		goto early_exit;
-	}
+	for (i = 0; i < ARRAY_SIZE(node_workers); ++i) {
+		worker = &node_workers[i];
+		worker->pipe_writer = -1;
+		worker->pollfds_len = 1;
 
-	ret = write_data(sock, msg->payload, gb_message_payload_len(msg));
-	if (ret != gb_message_payload_len(msg)) {
-		LOG_ERR("Failed to send Greybus Message Payload to node");
-		goto early_exit;
+		k_thread_create(&worker->thread, node_worker_stacks[i],
+				K_THREAD_STACK_SIZEOF(node_worker_stacks[i]), node_worker_entry, worker,
+				NULL, NULL, NODE_RX_THREAD_PRIORITY, 0, K_NO_WAIT);
+		k_thread_name_set(&worker->thread, "node_worker");
 	}
 
 	return 0;
-
-early_exit:
-	svc_send_module_removed_by_sock(sock);
-	return ret;
 }
 
-static int connect_to_node(const struct sockaddr *addr)
-{
-	int ret, sock;
-	size_t addr_size;
-
-	if (addr->sa_family == AF_INET6) {
-		sock = zsock_socket(AF_INET6, SOCK_STREAM, IPPROTO_TCP);
-		addr_size = sizeof(struct sockaddr_in6);
-	} else {
-		sock = zsock_socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
-		addr_size = sizeof(struct sockaddr_in);
-	}
-
-	if (sock < 0) {
-		LOG_ERR("Failed to create socket %d", errno);
-		return sock;
-	}
-
-	ret = zsock_connect(sock, addr, addr_size);
-	if (ret) {
-		LOG_ERR("Failed to connect to node %d", errno);
-		goto fail;
-	}
-
-	return sock;
-
-fail:
-	zsock_close(sock);
-	return ret;
-}
+SYS_INIT(node_workers_init, APPLICATION, CONFIG_APPLICATION_INIT_PRIORITY);
 
 static int node_intf_create_connection(struct gb_interface *ctrl, uint16_t cport_id)
 {
-	struct sockaddr_in6 node_addr;
-	int ret, sock;
+	struct node_item *node;
+	int ret;
 
 	/* Do not create socket for cports other than 0 */
 	if (cport_id != 0) {
 		return 0;
 	}
 
-	/* It is possible for cport 0 to be disconnected. Since we are not closing the tcp
-	 * socket, do not recreate an existing socket */
-	sock = POINTER_TO_INT(ctrl->ctrl_data);
-	if (sock >= 0) {
-		return sock;
-	}
+	k_mutex_lock(&node_tx_lock, K_FOREVER);
 
 	ret = node_cache_find_by_id(ctrl->id);
 	if (ret < 0) {
 		LOG_ERR("Failed to find node %u in cache. This should not happen", ctrl->id);
-		return -EINVAL;
+		ret = -EINVAL;
+		goto unlock;
 	}
 
-	memcpy(&node_addr.sin6_addr, &node_cache[ret].addr, sizeof(struct in6_addr));
-	node_addr.sin6_family = AF_INET6;
-	node_addr.sin6_scope_id = 0;
-	node_addr.sin6_port = htons(GB_TRANSPORT_TCPIP_BASE_PORT);
-
-	sock = connect_to_node((struct sockaddr *)&node_addr);
-	if (sock < 0) {
-		LOG_ERR("Failed to connect to node");
-		return sock;
+	/*
+	 * The first connection is made by the node worker without blocking, just like a
+	 * reconnect, and retried for up to the reconnect grace period. Messages to the node are
+	 * queued meanwhile.
+	 *
+	 * It is possible for cport 0 to be disconnected. Since we are not closing the tcp socket,
+	 * an existing connection is kept.
+	 */
+	node = &node_cache[ret];
+	if (node->link == NODE_LINK_IDLE) {
+		node->lost_at = k_uptime_get();
+		node->retry_at = node->lost_at;
+		node->backoff_ms = CONFIG_BEAGLEPLAY_NODE_RECONNECT_BACKOFF_MIN_MS;
+		node->link = NODE_LINK_BACKOFF;
+		atomic_inc(&node_workers[node->worker].recovering);
+		/* Wake the worker up to connect */
+		node_poll_mark(ret);
 	}
-	node_cache[ret].sock = sock;
-	ctrl->ctrl_data = INT_TO_POINTER(sock);
 
-	pipe_send();
+	ret = MAX(node->sock, 0);
 
-	return sock;
+unlock:
+	k_mutex_unlock(&node_tx_lock);
+
+	return ret;
 }
 
 static void node_intf_destroy_connection(struct gb_interface *ctrl, uint16_t cport_id)
@@ -407,19 +1254,11 @@ static void node_intf_destroy_connection(struct gb_interface *ctrl, uint16_t cpo
 
 static int node_inf_write(struct gb_interface *ctrl, struct gb_message *msg, uint16_t cport_id)
 {
-	int ret, sock = POINTER_TO_INT(ctrl->ctrl_data);
-
-	ret = gb_message_send(sock, msg, cport_id);
-	if (ret < 0) {
-		LOG_ERR("Socket seems closed");
-		tcpip_module_remove(ctrl);
-	}
-	gb_message_dealloc(msg);
-
-	return ret;
+	/* Socket errors are handled by the node worker while draining the queue */
+	return node_tx_queue(ctrl->id, msg, cport_id);
 }
 
-static struct gb_interface *node_create_interface(struct in6_addr *addr)
+static struct gb_interface *node_create_interface(struct in6_addr *addr, bool pinned)
 {
 	int ret;
 	struct gb_interface *inf;
@@ -432,9 +1271,11 @@ static struct gb_interface *node_create_interface(struct in6_addr *addr)
 	}
 
 	LOG_DBG("Create new interface with ID %u", inf->id);
-	ret = node_cache_add(-1, inf->id, addr, inf);
+	ret = node_cache_add(-1, inf->id, addr, inf, pinned);
 	if (ret < 0) {
-		LOG_ERR("Failed to add node to cache");
+		/* -EEXIST if another thread added the same node meanwhile */
+		LOG_ERR("Failed to add node to cache (%d)", ret);
+		gb_interface_dealloc(inf);
 		return NULL;
 	}
 
@@ -443,52 +1284,211 @@ static struct gb_interface *node_create_interface(struct in6_addr *addr)
 
 void node_destroy_interface(struct gb_interface *inf)
 {
-	int sock;
+	struct node_item *node;
+	int ret;
 
 	if (inf == NULL) {
 		return;
 	}
 
-	sock = POINTER_TO_INT(inf->ctrl_data);
-	if (sock >= 0) {
-		zsock_close(sock);
+	k_mutex_lock(&node_tx_lock, K_FOREVER);
+
+	ret = node_cache_find_by_id(inf->id);
+	if (ret < 0 || node_cache[ret].inf != inf) {
+		k_mutex_unlock(&node_tx_lock);
+		gb_interface_dealloc(inf);
+		return;
 	}
 
-	node_cache_remove_by_id(inf->id);
-	gb_interface_dealloc(inf);
+	/* The worker of the node may be using its socket and receive buffer right now */
+	node = &node_cache[ret];
+	node->destroy = true;
+	node_poll_mark(ret);
+
+	/* A reused slot has destroy cleared */
+	while (node->in_use && node->destroy) {
+		k_condvar_wait(&node_removed, &node_tx_lock, K_FOREVER);
+	}
+
+	k_mutex_unlock(&node_tx_lock);
 }
 
-void node_filter(struct in6_addr *active_addr, size_t active_len)
+/*
+ * Count a missed round for every node not seen in the current one and let the workers remove
+ * nodes which were missing for too long.
+ */
+static void node_filter_missing(void)
 {
+	struct node_item *node;
 	size_t i;
+
+	k_mutex_lock(&node_tx_lock, K_FOREVER);
+	for (i = 0; i < ARRAY_SIZE(node_cache); ++i) {
+		node = &node_cache[i];
+		if (!node->in_use || node->pinned || node->expired) {
+			continue;
+		}
+
+		if (node->generation == node_generation) {
+			node->fail_count = 0;
+			continue;
+		}
+
+		node->fail_count++;
+		LOG_DBG("Node %u missing from %u discovery rounds", node->id, node->fail_count);
+
+		if (CONFIG_BEAGLEPLAY_GREYBUS_DISCOVERY_MISSED_ROUNDS &&
+		    node->fail_count >= CONFIG_BEAGLEPLAY_GREYBUS_DISCOVERY_MISSED_ROUNDS) {
+			/* Let the node worker remove it */
+			node->expired = true;
+			node_poll_mark(i);
+		}
+	}
+	k_mutex_unlock(&node_tx_lock);
+}
+
+/*
+ * Announce new nodes to the AP from the system work queue, since discovery runs in the DNS
+ * resolver callback. The credits for the transmit queue of a node are sent first, so the AP has
+ * them before it can send anything to the node. Nodes are announced in id order, and the rest
+ * waits for a retry while the HDLC TX ring is full. A node whose credits cannot be sent for any
+ * other reason is left to its worker to remove. Discovery adds it back in a later round, a static
+ * node stays removed.
+ */
+static void node_insert_handler(struct k_work *work)
+{
+	size_t id;
+	int ret;
+
+	ARG_UNUSED(work);
+
+	for (id = 0; id <= UINT8_MAX; ++id) {
+		if (!atomic_test_and_clear_bit(node_insert_pending, id)) {
+			continue;
+		}
+
+		/* The node may have been removed before it was announced */
+		k_mutex_lock(&node_tx_lock, K_FOREVER);
+		ret = node_cache_find_by_id(id);
+		if (ret >= 0 && node_cache[ret].destroy) {
+			ret = -ENOENT;
+		}
+		k_mutex_unlock(&node_tx_lock);
+		if (ret < 0) {
+			continue;
+		}
+
+		ret = flow_control_grant_sync(id, CONFIG_BEAGLEPLAY_NODE_TX_QUEUE_DEPTH);
+		if (ret == -EAGAIN) {
+			atomic_set_bit(node_insert_pending, id);
+			k_work_schedule(&node_insert_work, K_MSEC(NODE_INSERT_RETRY_MS));
+			return;
+		}
+
+		if (ret < 0) {
+			k_mutex_lock(&node_tx_lock, K_FOREVER);
+			ret = node_cache_find_by_id(id);
+			if (ret >= 0) {
+				node_cache[ret].destroy = true;
+				node_poll_mark(ret);
+			}
+			k_mutex_unlock(&node_tx_lock);
+			continue;
+		}
+
+		gb_svc_send_module_inserted(id, 1, 0);
+	}
+}
+
+/* Queue a new node to be announced to the AP, see node_insert_handler() */
+static void node_module_insert(uint8_t id)
+{
+	atomic_set_bit(node_insert_pending, id);
+	k_work_reschedule(&node_insert_work, K_NO_WAIT);
+}
+
+void node_filter(struct in6_addr *active_addr, size_t active_len)
+{
+	uint8_t inserted[MAX_GREYBUS_NODES];
+	bool known[MAX_GREYBUS_NODES];
+	size_t i, inserted_len = 0;
 	struct gb_interface *inf;
 	int ret;
 
+	/* Rounds are deduplicated, and the cache cannot hold more nodes anyway */
+	active_len = MIN(active_len, ARRAY_SIZE(known));
+
+	k_mutex_lock(&node_tx_lock, K_FOREVER);
+	node_generation++;
 	for (i = 0; i < active_len; ++i) {
 		ret = node_cache_find_by_addr(&active_addr[i]);
+		known[i] = ret >= 0;
+		if (known[i]) {
+			/* A node which is back is kept, even if its removal was already scheduled */
+			node_cache[ret].generation = node_generation;
+			node_cache[ret].fail_count = 0;
+			node_cache[ret].expired = false;
+		}
+	}
+	k_mutex_unlock(&node_tx_lock);
+
+	/* Interfaces are created without node_tx_lock, the greybus library has its own locking */
+	for (i = 0; i < active_len; ++i) {
+		if (known[i]) {
+			continue;
+		}
 
 		/* Handle New Node */
-		if (ret < 0) {
-			LOG_DBG("New node discovered");
-			inf = node_create_interface(&active_addr[i]);
-			if (!inf) {
-				LOG_ERR("Failed to create interface");
-				continue;
-			}
-			gb_svc_send_module_inserted(inf->id, 1, 0);
+		LOG_DBG("New node discovered");
+		inf = node_create_interface(&active_addr[i], false);
+		if (!inf) {
+			LOG_ERR("Failed to create interface");
+			continue;
 		}
+		inserted[inserted_len++] = inf->id;
+	}
+
+	node_filter_missing();
+
+	/* Let the AP enumerate all new modules in one burst */
+	for (i = 0; i < inserted_len; ++i) {
+		node_module_insert(inserted[i]);
+	}
+}
+
+void node_add_static(struct in6_addr *addr)
+{
+	struct gb_interface *inf;
+	int ret;
+
+	k_mutex_lock(&node_tx_lock, K_FOREVER);
+	ret = node_cache_find_by_addr(addr);
+	k_mutex_unlock(&node_tx_lock);
+	if (ret >= 0) {
+		return;
+	}
+
+	inf = node_create_interface(addr, true);
+	if (!inf) {
+		LOG_ERR("Failed to create interface");
+		return;
 	}
+
+	node_module_insert(inf->id);
 }
 
 void node_destroy_all(void)
 {
+	struct gb_interface *inf;
 	size_t i;
 
-	for (i = 0; i < node_cache_pos; ++i) {
-		node_destroy_interface(node_cache[i].inf);
-	}
+	for (i = 0; i < ARRAY_SIZE(node_cache); ++i) {
+		k_mutex_lock(&node_tx_lock, K_FOREVER);
+		inf = node_cache[i].in_use ? node_cache[i].inf : NULL;
+		k_mutex_unlock(&node_tx_lock);
 
-	node_cache_pos = 0;
+		node_destroy_interface(inf);
+	}
 }
 
 void node_rx_start(void)
@@ -0,0 +1,138 @@
+// SPDX-License-Identifier: Apache-2.0
+/*
+ * Copyright (c) 2023 Ayush Singh <ayushdevel1325@gmail.com>
+ */
+
+#include "op_trace.h"
+#include <zephyr/kernel.h>
+#include <zephyr/sys/atomic.h>
+#include <zephyr/sys/byteorder.h>
+#include <zephyr/sys/util.h>
+
+#define OP_TRACE_ENTRIES CONFIG_BEAGLEPLAY_OP_TRACE_ENTRIES
+
+BUILD_ASSERT(IS_POWER_OF_TWO(OP_TRACE_ENTRIES), "Trace ring size must be a power of two");
+
+/* Cycle counter frequency, next sequence number and number of records */
+#define OP_TRACE_HDR_LEN    (2 * sizeof(uint32_t) + sizeof(uint8_t))
+#define OP_TRACE_RECORD_LEN (2 * sizeof(uint32_t) + 2 * sizeof(uint16_t) + 3 * sizeof(uint8_t))
+
+/**
+ * struct op_trace_entry - Trace ring entry
+ *
+ * @seq: sequence number + 1 once the entry is complete, 0 while it is being written
+ * @cycles: cycle counter at the trace point
+ * @cport_id: cport on the interface
+ * @operation_id: Greybus operation id, little endian as on the wire
+ * @point: enum op_trace_point
+ * @intf_id: interface id
+ * @type: Greybus message type
+ */
+struct op_trace_entry {
+	atomic_t seq;
+	uint32_t cycles;
+	uint16_t cport_id;
+	uint16_t operation_id;
+	uint8_t point;
+	uint8_t intf_id;
+	uint8_t type;
+};
+
+static struct op_trace_entry op_trace_ring[OP_TRACE_ENTRIES];
+/* Sequence number of the next entry to be claimed */
+static atomic_t op_trace_head;
+
+void op_trace_record(enum op_trace_point point, uint8_t intf_id, uint16_t cport_id,
+		     const struct gb_operation_msg_hdr *hdr)
+{
+	op_trace_record_at(point, k_cycle_get_32(), intf_id, cport_id, hdr);
+}
+
+void op_trace_record_at(enum op_trace_point point, uint32_t cycles, uint8_t intf_id,
+			uint16_t cport_id, const struct gb_operation_msg_hdr *hdr)
+{
+	uint32_t seq = atomic_inc(&op_trace_head);
+	struct op_trace_entry *entry = &op_trace_ring[seq & (OP_TRACE_ENTRIES - 1)];
+
+	/* Writers only race on an entry if the ring wraps around while one of them is preempted */
+	atomic_set(&entry->seq, 0);
+	entry->cycles = cycles;
+	entry->cport_id = cport_id;
+	entry->operation_id = hdr->operation_id;
+	entry->point = point;
+	entry->intf_id = intf_id;
+	entry->type = hdr->type;
+	atomic_set(&entry->seq, seq + 1);
+}
+
+/*
+ * Copy an entry if it still holds the record with the given sequence number.
+ *
+ * @return 0 if successful. -EAGAIN if the record is still being written, -ENOENT if it has been
+ * overwritten
+ */
+static int op_trace_read(uint32_t seq, struct op_trace_entry *out)
+{
+	struct op_trace_entry *entry = &op_trace_ring[seq & (OP_TRACE_ENTRIES - 1)];
+	uint32_t found = atomic_get(&entry->seq);
+
+	if (found != seq + 1) {
+		return (found == 0 || (int32_t)(found - (seq + 1)) < 0) ? -EAGAIN : -ENOENT;
+	}
+
+	out->cycles = entry->cycles;
+	out->cport_id = entry->cport_id;
+	out->operation_id = entry->operation_id;
+	out->point = entry->point;
+	out->intf_id = entry->intf_id;
+	out->type = entry->type;
+
+	/* A writer might have reused the entry while copying */
+	return (atomic_get(&entry->seq) == seq + 1) ? 0 : -ENOENT;
+}
+
+int op_trace_dump(uint32_t seq, uint8_t *buffer, size_t len)
+{
+	uint32_t head = atomic_get(&op_trace_head);
+	struct op_trace_entry entry;
+	uint8_t *pos = &buffer[OP_TRACE_HDR_LEN];
+	uint8_t count = 0;
+	int ret;
+
+	if (len < OP_TRACE_HDR_LEN) {
+		return -ENOBUFS;
+	}
+
+	/* Skip records which have been overwritten, or restart if asked for the future */
+	if ((int32_t)(head - seq) < 0 || head - seq > OP_TRACE_ENTRIES) {
+		seq = (head > OP_TRACE_ENTRIES) ? head - OP_TRACE_ENTRIES : 0;
+	}
+
+	for (; seq != head && len - (pos - buffer) >= OP_TRACE_RECORD_LEN && count < UINT8_MAX;
+	     ++seq) {
+		ret = op_trace_read(seq, &entry);
+		if (ret == -EAGAIN) {
+			break;
+		}
+
+		if (ret < 0) {
+			continue;
+		}
+
+		sys_put_le32(seq, &pos[0]);
+		sys_put_le32(entry.cycles, &pos[4]);
+		sys_put_le16(entry.cport_id, &pos[8]);
+		sys_put_le16(sys_le16_to_cpu(entry.operation_id), &pos[10]);
+		pos[12] = entry.point;
+		pos[13] = entry.intf_id;
+		pos[14] = entry.type;
+		pos += OP_TRACE_RECORD_LEN;
+		count++;
+	}
+
+	sys_put_le32(sys_clock_hw_cycles_per_sec(), &buffer[0]);
+	sys_put_le32(seq, &buffer[4]);
+	buffer[8] = count;
+
+	return pos - buffer;
+}
@@ -0,0 +1,187 @@
+// SPDX-License-Identifier: Apache-2.0
+/*
+ * Copyright (c) 2023 Ayush Singh <ayushdevel1325@gmail.com>
+ */
+
+#include "stats.h"
+#include "hdlc.h"
+#include "msg_pool.h"
+#include "node.h"
+#include <errno.h>
+#include <zephyr/kernel.h>
+#include <zephyr/sys/atomic.h>
+#include <zephyr/sys/byteorder.h>
+#include <zephyr/sys/util.h>
+
+/* Section, index and number of records */
+#define STATS_SNAPSHOT_HDR_LEN 3
+/* Interface id followed by the node counters */
+#define STATS_NODE_RECORD_LEN (1 + 6 * sizeof(uint32_t))
+
+/*
+ * The target is single core, so plain atomics are as cheap as per-CPU counters and never need
+ * to be summed up.
+ */
+static atomic_t stats_counters[STATS_COUNTER_COUNT];
+static atomic_t stats_latency[STATS_LATENCY_COUNT][STATS_LATENCY_BUCKETS];
+
+void stats_inc(enum stats_counter counter)
+{
+	atomic_inc(&stats_counters[counter]);
+}
+
+void stats_add(enum stats_counter counter, uint32_t value)
+{
+	atomic_add(&stats_counters[counter], value);
+}
+
+void stats_max(enum stats_counter counter, uint32_t value)
+{
+	atomic_val_t max = atomic_get(&stats_counters[counter]);
+
+	while (value > (uint32_t)max && !atomic_cas(&stats_counters[counter], max, value)) {
+		max = atomic_get(&stats_counters[counter]);
+	}
+}
+
+void stats_latency_record(enum stats_latency stage, uint32_t start)
+{
+	uint32_t us = k_cyc_to_us_floor32(k_cycle_get_32() - start);
+	size_t bucket = us ? 32 - __builtin_clz(us) : 0;
+
+	atomic_inc(&stats_latency[stage][MIN(bucket, STATS_LATENCY_BUCKETS - 1)]);
+}
+
+static uint8_t *stats_put_u32(uint8_t *buf, uint32_t value)
+{
+	sys_put_le32(value, buf);
+	return buf + sizeof(uint32_t);
+}
+
+static size_t stats_snapshot_counters(uint8_t index, uint8_t *buf, size_t len, uint8_t *count)
+{
+	uint8_t *pos = buf;
+	size_t i;
+
+	for (i = index; i < STATS_COUNTER_COUNT && len - (pos - buf) >= sizeof(uint32_t); ++i) {
+		pos = stats_put_u32(pos, atomic_get(&stats_counters[i]));
+		(*count)++;
+	}
+
+	return pos - buf;
+}
+
+static size_t stats_snapshot_latency(uint8_t index, uint8_t *buf, size_t len, uint8_t *count)
+{
+	uint8_t *pos = buf;
+	size_t i;
+
+	if (index >= STATS_LATENCY_COUNT) {
+		return 0;
+	}
+
+	for (i = 0; i < STATS_LATENCY_BUCKETS && len - (pos - buf) >= sizeof(uint32_t); ++i) {
+		pos = stats_put_u32(pos, atomic_get(&stats_latency[index][i]));
+		(*count)++;
+	}
+
+	return pos - buf;
+}
+
+static size_t stats_snapshot_nodes(uint8_t index, uint8_t *buf, size_t len, uint8_t *count)
+{
+	struct node_stats stats;
+	uint8_t *pos = buf;
+	size_t id;
+
+	for (id = index; id <= UINT8_MAX && len - (pos - buf) >= STATS_NODE_RECORD_LEN; ++id) {
+		if (node_stats_get(id, &stats) < 0) {
+			continue;
+		}
+
+		*pos++ = id;
+		pos = stats_put_u32(pos, stats.rx_msgs);
+		pos = stats_put_u32(pos, stats.rx_bytes);
+		pos = stats_put_u32(pos, stats.tx_msgs);
+		pos = stats_put_u32(pos, stats.tx_bytes);
+		pos = stats_put_u32(pos, stats.errors);
+		pos = stats_put_u32(pos, stats.reconnects);
+		(*count)++;
+	}
+
+	return pos - buf;
+}
+
+static size_t stats_snapshot_msg_pool(uint8_t index, uint8_t *buf, size_t len, uint8_t *count)
+{
+	struct msg_pool_stats stats;
+
+	if (len < 4 * sizeof(uint16_t) + sizeof(uint32_t) || msg_pool_stats_get(index, &stats) < 0) {
+		return 0;
+	}
+
+	sys_put_le16(stats.payload_size, &buf[0]);
+	sys_put_le16(stats.num_blocks, &buf[2]);
+	sys_put_le16(stats.used, &buf[4]);
+	sys_put_le16(stats.max_used, &buf[6]);
+	sys_put_le32(stats.failures, &buf[8]);
+	*count = 1;
+
+	return 4 * sizeof(uint16_t) + sizeof(uint32_t);
+}
+
+static size_t stats_snapshot_hdlc_tx(uint8_t index, uint8_t *buf, size_t len, uint8_t *count)
+{
+	struct hdlc_tx_stats stats;
+	uint8_t *pos = buf;
+
+	if (len < 4 * sizeof(uint32_t) || hdlc_tx_stats_get(index, &stats) < 0) {
+		return 0;
+	}
+
+	pos = stats_put_u32(pos, stats.frames);
+	pos = stats_put_u32(pos, stats.bytes);
+	pos = stats_put_u32(pos, stats.dropped);
+	pos = stats_put_u32(pos, stats.max_used);
+	*count = 1;
+
+	return pos - buf;
+}
+
+int stats_snapshot(uint8_t section, uint8_t index, uint8_t *buffer, size_t len)
+{
+	uint8_t *records = &buffer[STATS_SNAPSHOT_HDR_LEN];
+	uint8_t count = 0;
+	size_t ret;
+
+	if (len < STATS_SNAPSHOT_HDR_LEN) {
+		return -ENOBUFS;
+	}
+	len -= STATS_SNAPSHOT_HDR_LEN;
+
+	switch (section) {
+	case STATS_SECTION_COUNTERS:
+		ret = stats_snapshot_counters(index, records, len, &count);
+		break;
+	case STATS_SECTION_LATENCY:
+		ret = stats_snapshot_latency(index, records, len, &count);
+		break;
+	case STATS_SECTION_NODES:
+		ret = stats_snapshot_nodes(index, records, len, &count);
+		break;
+	case STATS_SECTION_MSG_POOL:
+		ret = stats_snapshot_msg_pool(index, records, len, &count);
+		break;
+	case STATS_SECTION_HDLC_TX:
+		ret = stats_snapshot_hdlc_tx(index, records, len, &count);
+		break;
+	default:
+		return -EINVAL;
+	}
+
+	buffer[0] = section;
+	buffer[1] = index;
+	buffer[2] = count;
+
+	return STATS_SNAPSHOT_HDR_LEN + ret;
+}
@@ -8,6 +8,8 @@
 #include <zephyr/kernel.h>
 #include <zephyr/logging/log.h>
 #include <zephyr/net/dns_resolve.h>
+#include <zephyr/net/net_event.h>
+#include <zephyr/net/net_mgmt.h>
 
 #define MAX_GREYBUS_NODES CONFIG_GREYBUS_APBRIDGE_CPORTS
 
@@ -15,36 +17,164 @@ LOG_MODULE_DECLARE(cc1352_greybus, CONFIG_BEAGLEPLAY_GREYBUS_LOG_LEVEL);
 
 #ifdef CONFIG_BEAGLEPLAY_GREYBUS_MDNS_DISCOVERY
 
+#define DISCOVERY_INTERVAL_MIN CONFIG_BEAGLEPLAY_GREYBUS_DISCOVERY_INTERVAL_MIN_MS
+#define DISCOVERY_INTERVAL_MAX CONFIG_BEAGLEPLAY_GREYBUS_DISCOVERY_INTERVAL_MAX_MS
+#define DISCOVERY_TTL_MS       (CONFIG_BEAGLEPLAY_GREYBUS_DISCOVERY_TTL * MSEC_PER_SEC)
+
+enum discovery_state {
+	DISCOVERY_RUNNING,
+	DISCOVERY_QUERY_ACTIVE,
+	/* Query again as soon as the active query finishes */
+	DISCOVERY_REQUERY,
+	/* The node set changed since the last round, do not back off */
+	DISCOVERY_CHANGED,
+};
+
+struct discovery_entry {
+	bool valid;
+	struct in6_addr addr;
+	int64_t expires_at;
+};
+
 static void handler(struct k_work *work);
 
-static K_WORK_DEFINE(node_discovery, handler);
+static K_WORK_DELAYABLE_DEFINE(node_discovery, handler);
+
+static struct discovery_entry discovery_cache[MAX_GREYBUS_NODES];
+/* Deduplicated answers of the current round */
+static struct in6_addr discovery_round[MAX_GREYBUS_NODES];
+static size_t discovery_round_len;
+/* Written by the DNS callback and the net_mgmt callback */
+static atomic_t discovery_interval = ATOMIC_INIT(DISCOVERY_INTERVAL_MIN);
+static atomic_t discovery_state;
+static struct net_mgmt_event_callback discovery_nbr_cb;
+
+static void discovery_cache_update(const struct in6_addr *addr)
+{
+	const int64_t expires_at = k_uptime_get() + DISCOVERY_TTL_MS;
+	struct discovery_entry *entry = NULL;
+	size_t i;
+
+	for (i = 0; i < ARRAY_SIZE(discovery_cache); ++i) {
+		if (discovery_cache[i].valid && net_ipv6_addr_cmp(&discovery_cache[i].addr, addr)) {
+			discovery_cache[i].expires_at = expires_at;
+			return;
+		}
+
+		if (!discovery_cache[i].valid && !entry) {
+			entry = &discovery_cache[i];
+		}
+	}
+
+	atomic_set_bit(&discovery_state, DISCOVERY_CHANGED);
+
+	if (!entry) {
+		LOG_WRN("Discovery cache full");
+		return;
+	}
+
+	entry->valid = true;
+	net_ipaddr_copy(&entry->addr, addr);
+	entry->expires_at = expires_at;
+}
+
+static void discovery_round_add(const struct in6_addr *addr)
+{
+	size_t i;
+
+	for (i = 0; i < discovery_round_len; ++i) {
+		if (net_ipv6_addr_cmp(&discovery_round[i], addr)) {
+			return;
+		}
+	}
+
+	if (discovery_round_len >= ARRAY_SIZE(discovery_round)) {
+		LOG_WRN("Too many nodes discovered");
+		return;
+	}
+
+	net_ipaddr_copy(&discovery_round[discovery_round_len++], addr);
+}
+
+static void discovery_cache_expire(void)
+{
+	const int64_t now = k_uptime_get();
+	size_t i;
+
+	for (i = 0; i < ARRAY_SIZE(discovery_cache); ++i) {
+		if (discovery_cache[i].valid && now >= discovery_cache[i].expires_at) {
+			discovery_cache[i].valid = false;
+			atomic_set_bit(&discovery_state, DISCOVERY_CHANGED);
+		}
+	}
+}
+
+/*
+ * Schedule the next query. Rounds which do not change the node set back the query interval off.
+ *
+ * @param true if the query ran to its end. Only complete rounds count as missed rounds for nodes
+ * which did not answer, a failed query is just retried.
+ */
+static void discovery_round_end(bool complete)
+{
+	atomic_val_t interval;
+	uint32_t delay;
+
+	if (complete) {
+		discovery_cache_expire();
+		node_filter(discovery_round, discovery_round_len);
+	}
+
+	if (atomic_test_and_clear_bit(&discovery_state, DISCOVERY_CHANGED)) {
+		atomic_set(&discovery_interval, DISCOVERY_INTERVAL_MIN);
+	} else {
+		/* Do not undo a reset by a new neighbour in the meantime */
+		interval = atomic_get(&discovery_interval);
+		atomic_cas(&discovery_interval, interval,
+			   MIN(interval * 2, DISCOVERY_INTERVAL_MAX));
+	}
+
+	delay = atomic_get(&discovery_interval);
+	if (atomic_test_and_clear_bit(&discovery_state, DISCOVERY_REQUERY)) {
+		delay = 0;
+	}
+
+	atomic_clear_bit(&discovery_state, DISCOVERY_QUERY_ACTIVE);
+	if (atomic_test_bit(&discovery_state, DISCOVERY_RUNNING)) {
+		LOG_DBG("Next discovery query in %u ms", delay);
+		k_work_reschedule(&node_discovery, K_MSEC(delay));
+	}
+}
 
 static void cb(enum dns_resolve_status status, struct dns_addrinfo *info, void *user_data)
 {
 	switch (status) {
 	case DNS_EAI_CANCELED:
 		LOG_DBG("Service request timeout");
-		k_work_submit(&node_discovery);
+		discovery_round_end(true);
 		break;
 	case DNS_EAI_INPROGRESS:
 		if (info) {
 			// Ignore all other responses
 			if (info->ai_family == NET_AF_INET6) {
 				LOG_DBG("Got node address");
-				node_filter(&net_sin6(&info->ai_addr)->sin6_addr, 1);
+				discovery_cache_update(&net_sin6(&info->ai_addr)->sin6_addr);
+				discovery_round_add(&net_sin6(&info->ai_addr)->sin6_addr);
 			}
 		}
 		break;
 	case DNS_EAI_ALLDONE:
 		LOG_DBG("All results received");
-		k_work_submit(&node_discovery);
+		discovery_round_end(true);
 		break;
 	case DNS_EAI_FAIL:
+		/* No answer at all, which says nothing about nodes known from earlier rounds */
 		LOG_DBG("No such name found.");
+		discovery_round_end(false);
 		break;
 	default:
 		LOG_WRN("Unhandled status %d received (errno %d)", status, errno);
-		k_work_submit(&node_discovery);
+		discovery_round_end(false);
 	}
 }
 
@@ -53,12 +183,44 @@ static void handler(struct k_work *work)
 	int ret;
 	const char *query = "_greybus._tcp.local";
 
+	if (atomic_test_and_set_bit(&discovery_state, DISCOVERY_QUERY_ACTIVE)) {
+		return;
+	}
+
+	discovery_round_len = 0;
+
 	ret = dns_resolve_service(dns_resolve_get_default(), query, NULL, cb, NULL,
 				  NODE_DISCOVERY_INTERVAL);
 	if (ret < 0) {
 		LOG_ERR("Cannot resolve DNS service (%d)", ret);
+		atomic_clear_bit(&discovery_state, DISCOVERY_QUERY_ACTIVE);
+		k_work_reschedule(&node_discovery, K_MSEC(atomic_get(&discovery_interval)));
 	}
 }
+
+/*
+ * A booting node first shows up as a new neighbour. Query right away instead of waiting for the
+ * backed off interval.
+ */
+static void discovery_nbr_handler(struct net_mgmt_event_callback *cb, uint64_t mgmt_event,
+				  struct net_if *iface)
+{
+	if (mgmt_event != NET_EVENT_IPV6_NBR_ADD ||
+	    !atomic_test_bit(&discovery_state, DISCOVERY_RUNNING)) {
+		return;
+	}
+
+	LOG_DBG("New neighbour, querying for nodes");
+	atomic_set(&discovery_interval, DISCOVERY_INTERVAL_MIN);
+	atomic_set_bit(&discovery_state, DISCOVERY_CHANGED);
+
+	if (atomic_test_bit(&discovery_state, DISCOVERY_QUERY_ACTIVE)) {
+		atomic_set_bit(&discovery_state, DISCOVERY_REQUERY);
+		return;
+	}
+
+	k_work_reschedule(&node_discovery, K_NO_WAIT);
+}
 #endif // CONFIG_BEAGLEPLAY_GREYBUS_MDNS_DISCOVERY
 
 void tcp_discovery_start(void)
@@ -71,25 +233,38 @@ void tcp_discovery_start(void)
 	for (i = 0, start = 0; i < ARRAY_SIZE(addr); i++) {
 		if (addr[i] == ',') {
 			net_ipaddr_parse(&addr[start], i - start, (struct sockaddr *)&addr6);
-			node_filter(&addr6.sin6_addr, 1);
+			node_add_static(&addr6.sin6_addr);
 			start = i + 1;
 		}
 	}
 
 	if (i > start) {
 		net_ipaddr_parse(&addr[start], i - start, (struct sockaddr *)&addr6);
-		node_filter(&addr6.sin6_addr, 1);
+		node_add_static(&addr6.sin6_addr);
 	}
 #endif // CONFIG_BEAGLEPLAY_GREYBUS_STATIC_NODES_ENABLE
 
 #ifdef CONFIG_BEAGLEPLAY_GREYBUS_MDNS_DISCOVERY
-	k_work_submit(&node_discovery);
+	if (atomic_test_and_set_bit(&discovery_state, DISCOVERY_RUNNING)) {
+		return;
+	}
+
+	atomic_set(&discovery_interval, DISCOVERY_INTERVAL_MIN);
+	net_mgmt_init_event_callback(&discovery_nbr_cb, discovery_nbr_handler,
+				     NET_EVENT_IPV6_NBR_ADD);
+	net_mgmt_add_event_callback(&discovery_nbr_cb);
+	k_work_reschedule(&node_discovery, K_NO_WAIT);
 #endif // CONFIG_BEAGLEPLAY_GREYBUS_MDNS_DISCOVERY
 }
 
 void tcp_discovery_stop(void)
 {
 #ifdef CONFIG_BEAGLEPLAY_GREYBUS_MDNS_DISCOVERY
-	k_work_cancel(&node_discovery);
+	if (!atomic_test_and_clear_bit(&discovery_state, DISCOVERY_RUNNING)) {
+		return;
+	}
+
+	net_mgmt_del_event_callback(&discovery_nbr_cb);
+	k_work_cancel_delayable(&node_discovery);
 #endif // CONFIG_BEAGLEPLAY_GREYBUS_MDNS_DISCOVERY
 }